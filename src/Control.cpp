@@ -0,0 +1,95 @@
+#include <cerrno>
+#include <vector>
+#include <sstream>
+#include "utils.h"
+#include "mangle.h"
+#include "Control.h"
+
+const std::string Control::FILE = "/.sfs-control";
+
+bool Control::match(const std::string &path)
+{
+    return path == FILE;
+}
+
+struct stat Control::getAttr(const Git &git)
+{
+    struct stat st = git.getAttr("/").stat;
+    st.st_mode = S_IFREG | 0600;
+    st.st_nlink = 1;
+    st.st_size = 0; // Generated on read
+    return st;
+}
+
+std::string Control::status(const Git &git)
+{
+    return git.inTransaction() ? "transaction\n" : "idle\n";
+}
+
+/** Arguments of a command, separated by tabs if there is any, so that they may contain
+ *  spaces, or by blanks otherwise
+ */
+static std::vector<std::string> split(const std::string &rest)
+{
+    std::vector<std::string> args;
+    std::string arg;
+    if (rest.find('\t') != std::string::npos)
+    {
+        std::istringstream in(rest);
+        while (std::getline(in, arg, '\t'))
+            if (!arg.empty())
+                args.push_back(arg);
+    }
+    else
+    {
+        std::istringstream in(rest);
+        while (in >> arg)
+            args.push_back(arg);
+    }
+    return args;
+}
+
+/** @return -EINVAL unless `path` is an absolute path in the tree other than the root
+ */
+static int checkPath(const std::string &path)
+{
+    if (path.length() < 2 || path[0] != '/' || path.back() == '/' || Control::match(path))
+        return -EINVAL;
+    return 0;
+}
+
+int Control::run(Git &git, const std::string &input)
+{
+    std::istringstream lines(input);
+    std::string line;
+    while (std::getline(lines, line))
+    {
+        std::istringstream words(line);
+        std::string command, rest;
+        if (!(words >> command))
+            continue;
+        std::getline(words >> std::ws, rest);
+        LOG << "control: " << line.c_str() << std::endl;
+
+        bool ok;
+        if (command == "begin")
+            ok = git.begin();
+        else if (command == "commit")
+            ok = git.commitTransaction(rest.empty() ? "transaction" : rest.c_str());
+        else if (command == "abort")
+            ok = git.abortTransaction();
+        else if (command == "clone")
+        {
+            std::vector<std::string> args = split(rest);
+            if (args.size() != 2 || checkPath(args[0]) < 0 || checkPath(args[1]) < 0)
+                return -EINVAL;
+            git.clone(path_mangle(args[0]), path_mangle(args[1]));
+            ok = true;
+        }
+        else
+            return -EINVAL;
+        if (!ok)
+            return command == "begin" ? -EBUSY : -EINVAL;
+    }
+    return 0;
+}
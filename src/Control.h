@@ -0,0 +1,42 @@
+#ifndef CONTROL_H_
+#define CONTROL_H_
+
+#include <string>
+#include <sys/stat.h>
+#include "Git.h"
+
+/** Commands to the file system, written to a hidden file at the root of the mount
+ *
+ *  /.sfs-control takes one command per line:
+ *
+ *      begin            Start a transaction. Changes are seen as they are made, but
+ *                       nothing is committed until
+ *      commit [msg]     which records all of them as a single commit, or
+ *      abort            which drops them all.
+ *      clone SRC DST    Copy file or directory SRC to DST, both absolute paths in the
+ *                       mount, without copying any data: DST shares the objects of
+ *                       SRC. Separate them by a tab if they contain spaces.
+ *
+ *  Files still open when the transaction ends are committed when closed, as usual,
+ *  and a clone copies what was last committed of them.
+ *  Reading the file tells whether a transaction is open.
+ */
+class Control
+{
+public:
+    static const std::string FILE;
+
+    static bool match(const std::string &path);
+
+    static struct stat getAttr(const Git &git);
+    /** What reading the file returns
+     */
+    static std::string status(const Git &git);
+    /** Run the commands in `input`
+     *  @return 0, or -errno of the first command that failed. Failures of the
+     *          repository are thrown as usual
+     */
+    static int run(Git &git, const std::string &input);
+};
+
+#endif // CONTROL_H_
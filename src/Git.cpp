@@ -1,10 +1,21 @@
 #include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <cerrno>
 #include <cassert>
 #include <cstdlib>
-#include <fstream>
+#include <map>
+#include <deque>
+#include <unordered_set>
+#include <mutex>
+#include <atomic>
+#include <thread>
 #include <iostream>
 #include "Git.h"
 #include "utils.h"
+#include "PathIndex.h"
+#include "Repacker.h"
+#include "RepoPool.h"
 #include <vector>
 
 int Git::refCount = 0;
@@ -28,10 +39,18 @@ int Git::checkErrorImpl(int error, const char *fn)
  */
 #define CHECK_ERROR(fn) Git::checkErrorImpl((fn), #fn)
 
-Git::Git(const std::string &path)
+Git::Git(const std::string &path, const Options &options)
 {
     if (++refCount == 1)
+    {
         CHECK_ERROR(git_libgit2_init());
+        if (options.cacheMaxSize)
+            CHECK_ERROR(git_libgit2_opts(GIT_OPT_SET_CACHE_MAX_SIZE, (ssize_t)options.cacheMaxSize));
+        if (options.mwindowSize)
+            CHECK_ERROR(git_libgit2_opts(GIT_OPT_SET_MWINDOW_SIZE, options.mwindowSize));
+        if (options.mwindowMappedLimit)
+            CHECK_ERROR(git_libgit2_opts(GIT_OPT_SET_MWINDOW_MAPPED_LIMIT, options.mwindowMappedLimit));
+    }
     try
     {
         CHECK_ERROR(git_repository_open_bare(&repo, path.c_str()));
@@ -50,24 +69,92 @@ Git::Git(const std::string &path)
         CHECK_ERROR(git_repository_index(&index_, repo));
         IndexPtr index(index_);
 
-        commit(index, nullptr, "Initial commit");
+        commit(index, nullptr, "Initial commit", {});
     }
     stat(path.c_str(), &rootStat);
     pthread_rwlock_init(&rwlock, nullptr);
+    pool.reset(new RepoPool(path, repo));
+    publishHead();
+    syncIndex();
+    pathIndex.reset(new PathIndex(std::string(git_repository_path(repo)) + "sfs-path-index"));
+    indexHistory();
 }
 
 Git::~Git()
 {
+    pathIndex.reset();
+    pool.reset();
     git_repository_free(repo);
     if (--refCount == 0)
         CHECK_ERROR(git_libgit2_shutdown());
     pthread_rwlock_destroy(&rwlock);
 }
 
+std::shared_ptr<const Git::Published> Git::current() const
+{
+    return std::atomic_load(&published);
+}
+
+void Git::publish(const git_oid &commit, const git_oid &tree)
+{
+    std::shared_ptr<Published> next(new Published);
+    next->commit = commit;
+    next->tree = tree;
+    std::atomic_store(&published, std::shared_ptr<const Published>(std::move(next)));
+}
+
+void Git::publishHead()
+{
+    git_object *obj = nullptr;
+    CHECK_ERROR(git_revparse_single(&obj, repo, "HEAD"));
+    CommitPtr commit((git_commit *)obj);
+    publish(*git_commit_id(commit.get()), *git_commit_tree_id(commit.get()));
+}
+
+void Git::syncIndex()
+{
+    git_index *index_;
+    CHECK_ERROR(git_repository_index(&index_, repo));
+    IndexPtr index(index_);
+    git_oid tree_id;
+    if (git_index_write_tree(&tree_id, index.get()) == 0 && git_oid_equal(&tree_id, &current()->tree))
+        return;
+    giterr_clear();
+
+    // Left behind by a transaction that never finished, or naming objects that are gone
+    git_tree *tree_ = nullptr;
+    CHECK_ERROR(git_tree_lookup(&tree_, repo, &current()->tree));
+    TreePtr tree(tree_);
+    CHECK_ERROR(git_index_read_tree(index.get(), tree.get()));
+    CHECK_ERROR(git_index_write(index.get()));
+    LOG << "index reset to the tree of HEAD" << std::endl;
+}
+
+std::string Git::resolveSpec(const char *spec) const
+{
+    // HEAD is what has been published, which may be ahead of the ref on disk
+    if (strncmp(spec, "HEAD", 4) != 0)
+        return spec;
+    char idstr[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(idstr, sizeof idstr, &current()->commit);
+    return idstr + std::string(spec + 4);
+}
+
+git_repository *Git::reader() const
+{
+    return pool->get();
+}
+
 Git::TreePtr Git::root(const char *spec) const
 {
+    if (strcmp(spec, "HEAD^{tree}") == 0)
+    {
+        git_tree *tree = nullptr;
+        CHECK_ERROR(git_tree_lookup(&tree, reader(), &current()->tree));
+        return TreePtr(tree);
+    }
     git_object *obj = nullptr;
-    CHECK_ERROR(git_revparse_single(&obj, repo, spec));
+    CHECK_ERROR(git_revparse_single(&obj, reader(), resolveSpec(spec).c_str()));
     git_tree *root = (git_tree*)obj;
     return TreePtr(root);
 }
@@ -129,22 +216,247 @@ void Git::checkout_branch(time_t timeoff)
     git_tree_free(tree);
     git_commit_free(last_commit);
     git_reference_free(new_branch);
+    publishHead();
 }
 Git::CommitPtr Git::head(const char *spec) const
 {
+    return head(repo, spec);
+}
+
+Git::CommitPtr Git::head(git_repository *from, const char *spec) const
+{
+    if (strcmp(spec, "HEAD") == 0)
+    {
+        git_commit *commit = nullptr;
+        CHECK_ERROR(git_commit_lookup(&commit, from, &current()->commit));
+        return CommitPtr(commit);
+    }
     git_object *obj = nullptr;
-    CHECK_ERROR(git_revparse_single(&obj, repo, spec));
+    CHECK_ERROR(git_revparse_single(&obj, from, resolveSpec(spec).c_str()));
     git_commit *root = (git_commit*)obj;
     return CommitPtr(root);
 }
 
+void Git::enableStaging(const StagingOdb::Config &config)
+{
+    staging = StagingOdb::attach(repo, config);
+    if (!staging)
+        throw Error(GIT_ERROR, "enableStaging: cannot attach the staging backend");
+}
+
+void Git::flush()
+{
+    RWlock mlock(rwlock);
+    flushStaged();
+}
+
+void Git::flushStaged()
+{
+    if (!staging) return;
+    CHECK_ERROR(staging->flush(repo, std::string(git_repository_path(repo)) + "objects/pack"));
+    if (!refPending) return;
+
+    // Objects are on disk now, publish the index and HEAD. The index of an open
+    // transaction waits for its commit
+    if (!transaction)
+    {
+        git_index *index_;
+        CHECK_ERROR(git_repository_index(&index_, repo));
+        IndexPtr index(index_);
+        CHECK_ERROR(git_index_write(index.get()));
+    }
+
+    git_reference *ref_ = nullptr, *updated_ = nullptr;
+    CHECK_ERROR(git_repository_head(&ref_, repo));
+    ReferencePtr ref(ref_);
+    CHECK_ERROR(git_reference_set_target(&updated_, ref.get(), &current()->commit, "sfs: flush staged objects"));
+    ReferencePtr updated(updated_);
+    refPending = false;
+}
+
+void Git::warmUp(unsigned levels, unsigned threads)
+{
+    // Pack indexes are loaded on the first search through each pack. Looking for an
+    // object that does not exist searches all of them. Not the null id, which libgit2
+    // answers without asking any backend
+    git_odb *odb_ = nullptr;
+    CHECK_ERROR(git_repository_odb(&odb_, repo));
+    OdbPtr odb(odb_);
+    CHECK_ERROR(git_odb_refresh(odb.get()));
+    git_oid absent;
+    memset(&absent, 0xff, sizeof absent);
+    git_odb_exists(odb.get(), &absent);
+    giterr_clear();
+    std::size_t packs = 0;
+    if (DIR *d = opendir((std::string(git_repository_path(repo)) + "objects/pack").c_str()))
+    {
+        while (struct dirent *ent = readdir(d))
+        {
+            std::size_t len = strlen(ent->d_name);
+            if (len > 4 && strcmp(ent->d_name + len - 4, ".idx") == 0)
+                packs++;
+        }
+        closedir(d);
+    }
+    LOG << "loaded the indexes of " << packs << " packs" << std::endl;
+
+    // Then the trees, level by level, each level shared among the threads
+    std::vector<git_oid> level(1, current()->tree);
+    std::size_t trees = 0;
+    for (unsigned depth = 0; depth < levels && !level.empty(); depth++)
+    {
+        std::vector<git_oid> next;
+        std::mutex lock;
+        std::atomic<std::size_t> cursor(0);
+        auto work = [&] ()
+        {
+            git_repository *r = reader();
+            std::vector<git_oid> found;
+            for (std::size_t i; (i = cursor++) < level.size(); )
+            {
+                git_tree *tree_ = nullptr;
+                if (git_tree_lookup(&tree_, r, &level[i]) < 0)
+                {
+                    giterr_clear();
+                    continue;
+                }
+                TreePtr tree(tree_);
+                for (std::size_t j = 0, n = git_tree_entrycount(tree.get()); j < n; j++)
+                {
+                    const git_tree_entry *e = git_tree_entry_byindex(tree.get(), j);
+                    if (git_tree_entry_type(e) == GIT_OBJ_TREE)
+                        found.push_back(*git_tree_entry_id(e));
+                }
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            next.insert(next.end(), found.begin(), found.end());
+        };
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads && i < level.size(); i++)
+            workers.emplace_back(work);
+        work();
+        for (auto &t : workers)
+            t.join();
+        trees += level.size();
+        level.swap(next);
+    }
+    LOG << "warmed up " << trees << " trees" << std::endl;
+}
+
+void Git::enableMetaCache()
+{
+    metaFile = std::string(git_repository_path(repo)) + "sfs-meta-cache";
+    std::shared_ptr<const MetaCache> cache(new MetaCache(metaFile));
+    if (cache->empty())
+        return;
+    git_oid root = rootTree();
+    if (!git_oid_equal(&cache->root(), &root))
+        LOG << "meta cache: HEAD has moved, only unchanged trees will hit" << std::endl;
+    std::atomic_store(&metaCache, cache);
+}
+
+void Git::saveMetaCache()
+{
+    if (metaFile.empty())
+        return;
+    std::lock_guard<std::mutex> guard(metaLock);
+    std::shared_ptr<const MetaCache> old = std::atomic_load(&metaCache);
+    git_oid root = rootTree();
+    if (old && git_oid_equal(&old->root(), &root))
+        return;
+
+    git_repository *r = reader();
+    git_odb *odb_ = nullptr;
+    CHECK_ERROR(git_repository_odb(&odb_, r));
+    OdbPtr odb(odb_);
+
+    // Every tree once, taking what the old snapshot has of it, so that only new
+    // trees are loaded and only new blobs have their headers read
+    std::vector<MetaCache::Item> items;
+    std::unordered_set<std::string> seen;
+    std::deque<git_oid> queue(1, root);
+    while (!queue.empty())
+    {
+        git_oid dir = queue.front();
+        queue.pop_front();
+        if (!seen.insert(std::string((const char *)dir.id, GIT_OID_RAWSZ)).second)
+            continue;
+        std::vector<MetaCache::Entry> entries;
+        if (!old || !old->list(dir, entries))
+        {
+            git_tree *tree_ = nullptr;
+            CHECK_ERROR(git_tree_lookup(&tree_, r, &dir));
+            TreePtr tree(tree_);
+            for (std::size_t i = 0, n = git_tree_entrycount(tree.get()); i < n; i++)
+            {
+                const git_tree_entry *e = git_tree_entry_byindex(tree.get(), i);
+                git_otype type = git_tree_entry_type(e);
+                if (type != GIT_OBJ_TREE && type != GIT_OBJ_BLOB)
+                    continue; // Submodules are not shown
+                MetaCache::Entry entry;
+                entry.name = git_tree_entry_name(e);
+                entry.id = *git_tree_entry_id(e);
+                entry.mode = git_tree_entry_filemode(e);
+                entry.size = 0;
+                if (type == GIT_OBJ_BLOB)
+                {
+                    std::size_t size;
+                    CHECK_ERROR(git_odb_read_header(&size, &type, odb.get(), &entry.id));
+                    entry.size = size;
+                }
+                entries.push_back(std::move(entry));
+            }
+        }
+        for (auto &entry : entries)
+        {
+            if (entry.mode == GIT_FILEMODE_TREE)
+                queue.push_back(entry.id);
+            items.push_back({ dir, std::move(entry) });
+        }
+    }
+
+    std::size_t count = items.size();
+    if (!MetaCache::save(metaFile, root, std::move(items)))
+        return;
+    LOG << "meta cache: saved " << count << " entries" << std::endl;
+    // Map what was just written, so that the trees of later commits hit as well
+    std::shared_ptr<const MetaCache> cache(new MetaCache(metaFile));
+    if (!cache->empty())
+        std::atomic_store(&metaCache, cache);
+}
+
+Git::TreePtr Git::revTree(const std::string &rev) const
+{
+    return root((rev + "^{tree}").c_str());
+}
+
 Git::TreeEntryPtr Git::getEntry(const std::string &path) const
+{
+    TreePtr root = this->root();
+    return getEntry(root.get(), path);
+}
+
+Git::TreeEntryPtr Git::getEntry(const git_tree *root, const std::string &path) const
+{
+    TreeEntryPtr e;
+    if (getEntry(root, path, e) < 0)
+        throw Error(GIT_ENOTFOUND, "getEntry: " + path + " not found");
+    return e;
+}
+
+int Git::getEntry(const git_tree *root, const std::string &path, TreeEntryPtr &out) const
 {
     assert(path.length() > 0 && path[0] == '/');
-    std::shared_ptr<git_tree> root = this->root();
     git_tree_entry *e = nullptr;
-    CHECK_ERROR(git_tree_entry_bypath(&e, root.get(), path.c_str() + 1));
-    return TreeEntryPtr(e);
+    int error = git_tree_entry_bypath(&e, root, path.c_str() + 1);
+    if (error == GIT_ENOTFOUND)
+    {
+        giterr_clear();
+        return -ENOENT;
+    }
+    CHECK_ERROR(error);
+    out = TreeEntryPtr(e);
+    return 0;
 }
 
 void Git::checkSig() const
@@ -169,33 +481,28 @@ void Git::checkSig() const
     }
 }
 
-void Git::dump(const std::string &path, const std::string &out_path, bool *out_executable) const
+Git::BlobPtr Git::dump(const std::string &path, bool *out_executable) const
 {
-    RWlock mlock(rwlock, false);
     // TODO(twd2): cache
     auto e = getEntry(path);
     const git_otype type = git_tree_entry_type(e.get());
     assert(type == GIT_OBJ_BLOB);
     git_filemode_t mode = git_tree_entry_filemode(e.get());
-    git_object *obj_ = nullptr;
-    CHECK_ERROR(git_tree_entry_to_object(&obj_, repo, e.get()));
-    ObjectPtr obj(obj_);
-    std::size_t size = git_blob_rawsize((git_blob*)(obj.get()));
-    const void *data = git_blob_rawcontent((git_blob*)(obj.get()));
-
-    std::ofstream fout(out_path.c_str());
-    fout.write((const char *)data, size);
-    fout.close();
+    git_blob *blob_ = nullptr;
+    CHECK_ERROR(git_blob_lookup(&blob_, reader(), git_tree_entry_id(e.get())));
+    BlobPtr blob(blob_);
 
     if (out_executable)
     {
         *out_executable = mode == GIT_FILEMODE_BLOB_EXECUTABLE;
     }
+    return blob;
 }
 
 void Git::commit(const std::string &in_path, const std::string &path, const char *msg, bool executable)
 {
     assert(path.length() > 0 && path[0] == '/');
+    if (beforeCommit) beforeCommit();
 
     git_oid blob_id;
     if (in_path != "")
@@ -210,6 +517,69 @@ void Git::commit(const std::string &in_path, const std::string &path, const char
     commit(blob_id, path, msg, executable);
 }
 
+void Git::commitFd(int fd, const std::string &path, const char *msg, bool executable)
+{
+    assert(path.length() > 0 && path[0] == '/');
+    if (beforeCommit) beforeCommit();
+
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        throw Error(GIT_ERROR, std::string("commitFd: ") + strerror(errno));
+    git_oid blob_id;
+    if (st.st_size == 0)
+    {
+        char c;
+        CHECK_ERROR(git_blob_create_frombuffer(&blob_id, repo, &c, 0));
+    }
+    else
+    {
+        void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED)
+            throw Error(GIT_ERROR, std::string("commitFd: ") + strerror(errno));
+        int error = git_blob_create_frombuffer(&blob_id, repo, data, st.st_size);
+        munmap(data, st.st_size);
+        CHECK_ERROR(error);
+    }
+    commit(blob_id, path, msg, executable);
+}
+
+void Git::commitBuffer(const void *data, std::size_t len, const std::string &path, const char *msg,
+                       bool executable)
+{
+    assert(path.length() > 0 && path[0] == '/');
+    git_oid blob_id;
+    CHECK_ERROR(git_blob_create_frombuffer(&blob_id, repo, data, len));
+    commit(blob_id, path, msg, executable);
+}
+
+git_odb_stream *Git::openBlob(std::size_t size)
+{
+    git_odb *odb_ = nullptr;
+    CHECK_ERROR(git_repository_odb(&odb_, repo));
+    OdbPtr odb(odb_);
+    git_odb_stream *stream = nullptr;
+    if (git_odb_open_wstream(&stream, odb.get(), size, GIT_OBJ_BLOB) < 0)
+    {
+        const git_error *e = giterr_last();
+        LOG << "openBlob: " << (e ? e->message : "no stream") << std::endl;
+        giterr_clear();
+        return nullptr;
+    }
+    return stream;
+}
+
+void Git::commitStream(git_odb_stream *stream, const std::string &path, const char *msg, bool executable)
+{
+    assert(path.length() > 0 && path[0] == '/');
+    if (beforeCommit) beforeCommit();
+
+    git_oid blob_id;
+    int error = git_odb_stream_finalize_write(&blob_id, stream);
+    git_odb_stream_free(stream);
+    CHECK_ERROR(error);
+    commit(blob_id, path, msg, executable);
+}
+
 void Git::commit(const git_oid &blob_id, const std::string &path, const char *msg, const bool executable)
 {
     assert(path.length() > 0 && path[0] == '/');
@@ -234,37 +604,203 @@ void Git::commit(const git_oid &blob_id, const std::string &path, const char *ms
     IndexPtr index(index_);
     CHECK_ERROR(git_index_add(index.get(), &e));
 
-    commit(index, this->head(), (std::string(msg) + " " + path).c_str());
+    commit(index, this->head(), (std::string(msg) + " " + path).c_str(), {{path, false}});
 }
 
-void Git::commit(const IndexPtr &index, const CommitPtr &head, const char *msg)
+void Git::commit(const IndexPtr &index, const CommitPtr &head, const char *msg,
+                 const std::vector<Change> &changes)
 {
     char idstr[256];
-    git_oid tree_id, commit_id;
-
-    git_signature *sig_;
-    CHECK_ERROR(git_signature_default(&sig_, repo));
-    SigPtr sig(sig_);
+    git_oid tree_id;
 
-    CHECK_ERROR(git_index_write(index.get()));
+    if (!staging && !transaction) // A transaction keeps its index in memory until it commits
+        CHECK_ERROR(git_index_write(index.get()));
     CHECK_ERROR(git_index_write_tree(&tree_id, index.get()));
 
     memset(idstr, 0, sizeof(idstr));
     git_oid_fmt(idstr, &tree_id);
     LOG << "tree id " << idstr << std::endl;
 
+    if (transaction)
+    {
+        // Visible right away, but only committed with the rest of the transaction
+        publish(current()->commit, tree_id);
+        transaction->changes.insert(transaction->changes.end(), changes.begin(), changes.end());
+        if (afterCommit)
+            afterCommit(changes);
+        return;
+    }
+
+    commitTree(tree_id, head, msg, changes);
+    if (afterCommit)
+        afterCommit(changes);
+    Repacker::notifyCommit();
+    if (staging && staging->full())
+        flushStaged();
+}
+
+void Git::commitTree(const git_oid &tree_id, const CommitPtr &head, const char *msg,
+                     const std::vector<Change> &changes)
+{
+    char idstr[256];
+    git_oid commit_id;
+
+    git_signature *sig_;
+    CHECK_ERROR(git_signature_default(&sig_, repo));
+    SigPtr sig(sig_);
+
     git_tree *tree_;
     CHECK_ERROR(git_tree_lookup(&tree_, repo, &tree_id));
     TreePtr tree(tree_);
 
     CHECK_ERROR(git_commit_create_v(
-      &commit_id, repo, "HEAD", sig.get(), sig.get(),
+      &commit_id, repo, staging ? nullptr : "HEAD", sig.get(), sig.get(),
       nullptr, msg, tree.get(), 1, head.get()
     ));
+    refPending = staging != nullptr;
+    publish(commit_id, tree_id);
 
     memset(idstr, 0, sizeof(idstr));
     git_oid_fmt(idstr, &commit_id);
     LOG << "commit id " << idstr << std::endl;
+
+    if (pathIndex)
+        pathIndex->record(commit_id, sig->when.time, changes);
+}
+
+bool Git::begin()
+{
+    RWlock mlock(rwlock);
+    if (transaction)
+        return false;
+    if (beforeCommit) beforeCommit(); // Journaled writes so far are not part of it
+    transaction.reset(new Transaction);
+    LOG << "transaction begins" << std::endl;
+    return true;
+}
+
+bool Git::commitTransaction(const char *msg)
+{
+    RWlock mlock(rwlock);
+    if (!transaction)
+        return false;
+    if (beforeCommit) beforeCommit();
+    std::unique_ptr<Transaction> t(std::move(transaction));
+    if (t->changes.empty())
+        return true;
+
+    // A path touched several times is recorded once, as it ends up
+    std::map<std::string, bool> last;
+    for (const auto &change : t->changes)
+        last[change.path] = change.removed;
+    std::vector<Change> changes;
+    for (const auto &p : last)
+        changes.push_back({p.first, p.second});
+
+    if (!staging)
+    {
+        git_index *index_;
+        CHECK_ERROR(git_repository_index(&index_, repo));
+        IndexPtr index(index_);
+        CHECK_ERROR(git_index_write(index.get()));
+    }
+    commitTree(current()->tree, head(), msg, changes);
+    Repacker::notifyCommit();
+    if (staging && staging->full())
+        flushStaged();
+    return true;
+}
+
+bool Git::abortTransaction()
+{
+    RWlock mlock(rwlock);
+    if (!transaction)
+        return false;
+    if (beforeCommit) beforeCommit();
+    std::unique_ptr<Transaction> t(std::move(transaction));
+
+    // HEAD has not moved since `begin`; go back to its tree
+    CommitPtr base = head();
+    git_tree *tree_ = nullptr;
+    CHECK_ERROR(git_commit_tree(&tree_, base.get()));
+    TreePtr tree(tree_);
+    git_index *index_;
+    CHECK_ERROR(git_repository_index(&index_, repo));
+    IndexPtr index(index_);
+    CHECK_ERROR(git_index_read_tree(index.get(), tree.get()));
+    if (!staging)
+        CHECK_ERROR(git_index_write(index.get()));
+    publish(*git_commit_id(base.get()), *git_tree_id(tree.get()));
+    LOG << "transaction aborted, " << t->changes.size() << " changes dropped" << std::endl;
+
+    std::vector<Change> undone;
+    for (const auto &change : t->changes)
+        undone.push_back({change.path, !change.removed});
+    if (afterCommit)
+        afterCommit(undone);
+    return true;
+}
+
+bool Git::inTransaction() const
+{
+    RWlock mlock(rwlock, false);
+    return transaction != nullptr;
+}
+
+void Git::indexHistory()
+{
+    const git_oid *last = pathIndex->last();
+    std::vector<std::pair<Version, std::vector<Change> > > pending;
+    CommitPtr commit = head();
+    while (!last || git_oid_cmp(git_commit_id(commit.get()), last))
+    {
+        git_tree *tree_ = nullptr, *parentTree_ = nullptr;
+        CHECK_ERROR(git_commit_tree(&tree_, commit.get()));
+        TreePtr tree(tree_), parentTree;
+        CommitPtr parent;
+        if (git_commit_parentcount(commit.get()) > 0)
+        {
+            git_commit *parent_ = nullptr;
+            CHECK_ERROR(git_commit_parent(&parent_, commit.get(), 0));
+            parent = CommitPtr(parent_);
+            CHECK_ERROR(git_commit_tree(&parentTree_, parent.get()));
+            parentTree = TreePtr(parentTree_);
+        }
+
+        git_diff *diff_ = nullptr;
+        CHECK_ERROR(git_diff_tree_to_tree(&diff_, repo, parentTree.get(), tree.get(), nullptr));
+        DiffPtr diff(diff_);
+        std::vector<Change> changes;
+        for (std::size_t i = 0, n = git_diff_num_deltas(diff.get()); i < n; i++)
+        {
+            const git_diff_delta *delta = git_diff_get_delta(diff.get(), i);
+            bool removed = delta->status == GIT_DELTA_DELETED;
+            changes.push_back({"/" + std::string(removed ? delta->old_file.path : delta->new_file.path), removed});
+        }
+        Version v;
+        v.id = *git_commit_id(commit.get());
+        v.time = git_commit_time(commit.get());
+        pending.emplace_back(v, std::move(changes));
+
+        if (!parent)
+        {
+            if (last)
+            {
+                // The last recorded commit is not on this history (e.g. another branch
+                // was selected), start over
+                LOG << "path index: rebuilding" << std::endl;
+                pathIndex->clear();
+                last = nullptr;
+                pending.clear();
+                commit = head();
+                continue;
+            }
+            break;
+        }
+        commit = std::move(parent);
+    }
+    for (auto p = pending.rbegin(); p != pending.rend(); ++p)
+        pathIndex->record(p->first.id, p->first.time, p->second);
 }
 
 void Git::commit_remove(const std::string &path, const char *msg)
@@ -276,12 +812,13 @@ void Git::commit_remove(const std::string &path, const char *msg)
     IndexPtr index(index_);
     CHECK_ERROR(git_index_remove_bypath(index.get(), path.c_str() + 1));
 
-    commit(index, this->head(), (std::string(msg) + " " + path).c_str());
+    commit(index, this->head(), (std::string(msg) + " " + path).c_str(), {{path, true}});
 }
 
 void Git::truncate(const std::string &path, std::size_t size)
 {
     RWlock mlock(rwlock);
+    if (beforeCommit) beforeCommit();
     assert(path.length() > 0 && path[0] == '/');
     auto e = getEntry(path);
     const git_otype type = git_tree_entry_type(e.get());
@@ -312,6 +849,7 @@ void Git::truncate(const std::string &path, std::size_t size)
 void Git::unlink(const std::string &path, const char *msg)
 {
     RWlock mlock(rwlock);
+    if (beforeCommit) beforeCommit();
     assert(path.length() > 0 && path[0] == '/');
     auto e = getEntry(path);
 
@@ -330,30 +868,29 @@ void Git::unlink(const std::string &path, const char *msg)
 
 Git::FileAttr Git::getAttr(const git_tree_entry *entry) const
 {
-    FileAttr attr;
-
     const git_otype type = git_tree_entry_type(entry);
     assert(type == GIT_OBJ_TREE || type == GIT_OBJ_BLOB);
-    bool isDir = (type == GIT_OBJ_TREE);
-    git_filemode_t mode = git_tree_entry_filemode(entry);
-
-    attr.name = git_tree_entry_name(entry);
-    attr.stat.st_mode = mode | (isDir ? (S_IFDIR | 0755) : S_IFREG);
-    attr.stat.st_uid = rootStat.st_uid;
-    attr.stat.st_gid = rootStat.st_gid;
-    attr.stat.st_nlink = 1;
-
+    std::size_t size = 0;
     if (type == GIT_OBJ_BLOB)
     {
         git_object *obj_ = NULL;
-        CHECK_ERROR(git_tree_entry_to_object(&obj_, repo, entry));
+        CHECK_ERROR(git_tree_entry_to_object(&obj_, reader(), entry));
         ObjectPtr obj(obj_);
-        attr.stat.st_size = git_blob_rawsize((git_blob*)(obj.get()));
-    }
-    else
-    {
-        attr.stat.st_size = 4096;
+        size = git_blob_rawsize((git_blob*)(obj.get()));
     }
+    return getAttr(git_tree_entry_name(entry), git_tree_entry_filemode(entry), size);
+}
+
+Git::FileAttr Git::getAttr(const std::string &name, git_filemode_t mode, std::size_t size) const
+{
+    FileAttr attr;
+    bool isDir = (mode == GIT_FILEMODE_TREE);
+    attr.name = name;
+    attr.stat.st_mode = mode | (isDir ? (S_IFDIR | 0755) : S_IFREG);
+    attr.stat.st_uid = rootStat.st_uid;
+    attr.stat.st_gid = rootStat.st_gid;
+    attr.stat.st_nlink = 1;
+    attr.stat.st_size = isDir ? 4096 : size;
     return attr;
 }
 
@@ -379,47 +916,150 @@ int Git::treeWalkCallback(const char *root, const git_tree_entry *entry, void *_
 
 std::vector<Git::FileAttr> Git::listDir(const std::string &path) const
 {
+    return listDir(this->root(), path);
+}
 
-    TreePtr root = this->root(), tree = nullptr;
+int Git::listDir(const std::string &path, std::vector<FileAttr> &out) const
+{
+    return listDir(this->root(), path, out);
+}
+
+std::vector<Git::FileAttr> Git::listDir(TreePtr root, const std::string &path) const
+{
+    std::vector<FileAttr> list;
+    if (listDir(std::move(root), path, list) < 0)
+        throw Error(GIT_ENOTFOUND, "listDir: " + path + " not found");
+    return list;
+}
+
+int Git::listDir(TreePtr root, const std::string &path, std::vector<FileAttr> &out) const
+{
+    TreePtr tree = nullptr;
+    git_oid dir;
 
     assert(path.length() > 0 && path[0] == '/');
+    if (path == "/")
+        dir = *git_tree_id(root.get());
+    else {
+        TreeEntryPtr e;
+        int err = getEntry(root.get(), path, e);
+        if (err < 0)
+            return err;
+        if (git_tree_entry_type(e.get()) != GIT_OBJ_TREE)
+            return -ENOTDIR;
+        dir = *git_tree_entry_id(e.get());
+    }
+
+    std::shared_ptr<const MetaCache> cache = std::atomic_load(&metaCache);
+    std::vector<MetaCache::Entry> entries;
+    if (cache && cache->list(dir, entries))
+    {
+        out.clear();
+        for (const auto &e : entries)
+            out.push_back(getAttr(e.name, e.mode, e.size));
+        return 0;
+    }
+
     if (path == "/")
         tree = std::move(root);
     else {
         git_tree *tree_ = NULL;
-        RWlock mlock(rwlock, false);
-        auto e = getEntry(path);
-        assert(git_tree_entry_type(e.get()) == GIT_OBJ_TREE);
-        CHECK_ERROR(git_tree_lookup(&tree_, repo, git_tree_entry_id(e.get())));
+        CHECK_ERROR(git_tree_lookup(&tree_, reader(), &dir));
         tree = TreePtr(tree_);
     }
 
     WalkPayload payload;
     payload.git = this;
     CHECK_ERROR(git_tree_walk(tree.get(), GIT_TREEWALK_PRE, treeWalkCallback, &payload));
-    return payload.list;
+    out = std::move(payload.list);
+    return 0;
 }
 
 Git::FileAttr Git::getAttr(const std::string &path) const
 {
-    RWlock mlock(rwlock, false);
+    TreePtr root = this->root();
+    return getAttr(root.get(), path);
+}
+
+int Git::getAttr(const std::string &path, FileAttr &out) const
+{
+    TreePtr root = this->root();
+    return getAttr(root.get(), path, out);
+}
+
+git_oid Git::rootTree() const
+{
+    return current()->tree;
+}
+
+int Git::lookup(const git_oid &tree, const std::string &name, FileAttr &out, git_oid *out_id) const
+{
+    std::shared_ptr<const MetaCache> cache = std::atomic_load(&metaCache);
+    MetaCache::Entry entry;
+    int found = cache ? cache->find(tree, name, entry) : 1;
+    if (found < 0)
+        return found;
+    if (found == 0)
+    {
+        if (out_id)
+            *out_id = entry.id;
+        out = getAttr(entry.name, entry.mode, entry.size);
+        return 0;
+    }
+
+    git_tree *tree_ = nullptr;
+    CHECK_ERROR(git_tree_lookup(&tree_, reader(), &tree));
+    TreePtr dir(tree_);
+    const git_tree_entry *e = git_tree_entry_byname(dir.get(), name.c_str());
+    if (!e)
+        return -ENOENT;
+    if (out_id)
+        *out_id = *git_tree_entry_id(e);
+    out = getAttr(e);
+    return 0;
+}
+
+std::vector<std::string> Git::names(const git_oid &tree) const
+{
+    git_tree *tree_ = nullptr;
+    CHECK_ERROR(git_tree_lookup(&tree_, reader(), &tree));
+    TreePtr dir(tree_);
+    std::vector<std::string> list;
+    std::size_t count = git_tree_entrycount(dir.get());
+    for (std::size_t i = 0; i < count; i++)
+        list.push_back(git_tree_entry_name(git_tree_entry_byindex(dir.get(), i)));
+    return list;
+}
+
+Git::FileAttr Git::getAttr(const git_tree *root, const std::string &path) const
+{
     FileAttr attr;
+    if (getAttr(root, path, attr) < 0)
+        throw Error(GIT_ENOTFOUND, "getAttr: " + path + " not found");
+    return attr;
+}
 
+int Git::getAttr(const git_tree *root, const std::string &path, FileAttr &out) const
+{
     assert(path.length() > 0 && path[0] == '/');
     if (path == "/")
     {
         // '/' is not an entry
-        attr.stat = rootStat;
+        out.stat = rootStat;
     } else {
-        auto e = getEntry(path);
-        attr = getAttr(e.get());
+        TreeEntryPtr e;
+        int err = getEntry(root, path, e);
+        if (err < 0)
+            return err;
+        out = getAttr(e.get());
     }
-    return attr;
+    return 0;
 }
 
 void Git::chmod(const std::string &path, const bool executable)
 {
     RWlock mlock(rwlock);
+    if (beforeCommit) beforeCommit();
     auto e = getEntry(path);
     const git_otype type = git_tree_entry_type(e.get());
     if (type != GIT_OBJ_BLOB) return;
@@ -434,6 +1074,7 @@ void Git::rename(const std::string &oldname, const std::string &newname,
                  const std::function<void (const std::string &, const std::string &)> &cb)
 {
     RWlock mlock(rwlock);
+    if (beforeCommit) beforeCommit();
     assert(oldname.length() > 0 && oldname[0] == '/');
     assert(newname.length() > 0 && newname[0] == '/');
     auto e = getEntry(oldname);
@@ -443,6 +1084,7 @@ void Git::rename(const std::string &oldname, const std::string &newname,
     CHECK_ERROR(git_repository_index(&index_, repo));
     IndexPtr index(index_);
     size_t pos;
+    std::vector<Change> changes;
     if (type == GIT_OBJ_BLOB)
     {
         CHECK_ERROR(git_index_find_prefix(&pos, index.get(), oldname.c_str() + 1));
@@ -453,6 +1095,8 @@ void Git::rename(const std::string &oldname, const std::string &newname,
         CHECK_ERROR(git_index_add(index.get(), &e));
         CHECK_ERROR(git_index_remove_bypath(index.get(), entry->path));
         cb(oldname, newname);
+        changes.push_back({oldname, true});
+        changes.push_back({newname, false});
     }
     else // type == GIT_OBJ_TREE
     {
@@ -477,6 +1121,8 @@ void Git::rename(const std::string &oldname, const std::string &newname,
             //              be added into index in the following for-loop. Thus, they
             //              would be missing.
             cb("/" + filename, "/" + new_filename);
+            changes.push_back({"/" + filename, true});
+            changes.push_back({"/" + new_filename, false});
 
             // next entry
             entry = git_index_get_byindex(index.get(), pos);
@@ -489,7 +1135,126 @@ void Git::rename(const std::string &oldname, const std::string &newname,
         }
     }
 
-    commit(index, this->head(), ("rename " + oldname + " to " + newname).c_str());
+    // Times set explicitly go along, as in rsync's rename of its temporary file
+    auto touched = pathIndex->touchesBelow(oldname);
+    commit(index, this->head(), ("rename " + oldname + " to " + newname).c_str(), changes);
+    for (const auto &t : touched)
+        pathIndex->touch(newname + t.first, t.second);
+}
+
+void Git::clone(const std::string &src, const std::string &dst)
+{
+    RWlock mlock(rwlock);
+    if (beforeCommit) beforeCommit();
+    assert(src.length() > 1 && src[0] == '/');
+    assert(dst.length() > 1 && dst[0] == '/');
+    TreePtr root = this->root();
+    TreeEntryPtr e, existing;
+    if (getEntry(root.get(), src, e) < 0)
+        throw Error(GIT_ENOTFOUND, "clone: " + src + " not found");
+    if (getEntry(root.get(), dst, existing) == 0)
+        throw Error(GIT_EEXISTS, "clone: " + dst + " exists");
+    std::string dir = dst.substr(0, dst.rfind('/'));
+    FileAttr parent;
+    if (getAttr(root.get(), dir.empty() ? "/" : dir, parent) < 0 || !S_ISDIR(parent.stat.st_mode))
+        throw Error(GIT_ENOTFOUND, "clone: no directory for " + dst);
+
+    git_index *index_;
+    CHECK_ERROR(git_repository_index(&index_, repo));
+    IndexPtr index(index_);
+    std::vector<git_index_entry> entries;
+    std::vector<std::string> paths;
+    if (git_tree_entry_type(e.get()) == GIT_OBJ_BLOB)
+    {
+        git_index_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.id = *git_tree_entry_id(e.get());
+        entry.mode = git_tree_entry_filemode(e.get());
+        entries.push_back(entry);
+        paths.push_back(dst.substr(1));
+    }
+    else
+    {
+        // The objects are shared; only the index entries are new
+        std::string oldpath = src.substr(1) + '/';
+        std::string newpath = dst.substr(1) + '/';
+        size_t pos;
+        CHECK_ERROR(git_index_find_prefix(&pos, index.get(), oldpath.c_str()));
+        const git_index_entry *entry;
+        while ((entry = git_index_get_byindex(index.get(), pos++)) &&
+               strncmp(entry->path, oldpath.c_str(), oldpath.length()) == 0)
+        {
+            entries.push_back(*entry);
+            paths.push_back(newpath + (entry->path + oldpath.length()));
+        }
+    }
+
+    std::vector<Change> changes;
+    for (std::size_t i = 0; i < entries.size(); i++)
+    {
+        entries[i].path = paths[i].c_str();
+        CHECK_ERROR(git_index_add(index.get(), &entries[i]));
+        changes.push_back({"/" + paths[i], false});
+    }
+    auto touched = pathIndex->touchesBelow(src);
+    commit(index, this->head(), ("clone " + src + " to " + dst).c_str(), changes);
+    for (const auto &t : touched)
+        pathIndex->touch(dst + t.first, t.second);
+}
+
+std::vector<Git::Version> Git::listVersions() const
+{
+    std::vector<Version> list;
+    CommitPtr commit = head(reader(), "HEAD");
+    while (true)
+    {
+        Version v;
+        v.id = *git_commit_id(commit.get());
+        v.time = git_commit_time(commit.get());
+        list.push_back(v);
+        if (git_commit_parentcount(commit.get()) == 0)
+            break;
+        git_commit *parent_ = nullptr;
+        CHECK_ERROR(git_commit_parent(&parent_, commit.get(), 0));
+        commit = CommitPtr(parent_);
+    }
+    return list;
+}
+
+std::vector<Git::Version> Git::listVersions(const std::string &path) const
+{
+    return pathIndex->versions(path);
+}
+
+void Git::times(const std::string &path, time_t *out_mtime, time_t *out_ctime) const
+{
+    pathIndex->times(path, out_mtime, out_ctime);
+}
+
+void Git::touch(const std::string &path, time_t mtime)
+{
+    pathIndex->touch(path, mtime);
+}
+
+std::vector<Git::FileAttr> Git::listDir(const std::string &rev, const std::string &path) const
+{
+    return listDir(revTree(rev), path);
+}
+
+Git::FileAttr Git::getAttr(const std::string &rev, const std::string &path) const
+{
+    TreePtr root = revTree(rev);
+    return getAttr(root.get(), path);
+}
+
+Git::BlobPtr Git::blob(const std::string &rev, const std::string &path) const
+{
+    TreePtr root = revTree(rev);
+    auto e = getEntry(root.get(), path);
+    assert(git_tree_entry_type(e.get()) == GIT_OBJ_BLOB);
+    git_blob *blob_ = nullptr;
+    CHECK_ERROR(git_blob_lookup(&blob_, reader(), git_tree_entry_id(e.get())));
+    return BlobPtr(blob_);
 }
 
 #undef CHECK_ERROR
@@ -11,6 +11,12 @@
 #include <memory>
 #include <pthread.h>
 #include <functional>
+#include <mutex>
+#include "StagingOdb.h"
+#include "MetaCache.h"
+
+class PathIndex;
+class RepoPool;
 
 /** Helper for creating smart pointer
  */
@@ -76,6 +82,34 @@ public:
         FileAttr() { memset(&stat, 0, sizeof stat); }
     };
 
+    /** A commit on the first-parent history of HEAD
+     */
+    struct Version
+    {
+        git_oid id;
+        time_t time;
+    };
+
+    /** A path touched by a commit
+     */
+    struct Change
+    {
+        std::string path;
+        bool removed;
+    };
+
+    /** Global libgit2 options, 0 for the libgit2 default
+     */
+    struct Options
+    {
+        std::size_t cacheMaxSize = 0; /// Object cache of all repository handles together
+        std::size_t mwindowSize = 0; /// Size of each mapped window of a packfile
+        std::size_t mwindowMappedLimit = 0; /// Total size of mapped pack windows
+    };
+
+    /** Pointer class of blobs handed out to readers */
+    BUILD_PTR(BlobPtr, git_blob);
+
 private:
     /** Pointer classes that automatically free objects when an exception is threw */
     BUILD_PTR(IndexPtr, git_index);
@@ -84,14 +118,65 @@ private:
     BUILD_PTR(CommitPtr, git_commit);
     BUILD_PTR(TreeEntryPtr, git_tree_entry);
     BUILD_PTR(ObjectPtr, git_object);
+    BUILD_PTR(DiffPtr, git_diff);
+    BUILD_PTR(ReferencePtr, git_reference);
+    BUILD_PTR(OdbPtr, git_odb);
 
     TreePtr root(const char *spec = "HEAD^{tree}") const;
     CommitPtr head(const char *spec = "HEAD") const;
+    CommitPtr head(git_repository *from, const char *spec) const;
+    TreePtr revTree(const std::string &rev) const;
     TreeEntryPtr getEntry(const std::string &path) const;
+    TreeEntryPtr getEntry(const git_tree *root, const std::string &path) const;
 
     FileAttr getAttr(const git_tree_entry *entry) const;
+    FileAttr getAttr(const std::string &name, git_filemode_t mode, std::size_t size) const;
+    FileAttr getAttr(const git_tree *root, const std::string &path) const;
+    std::vector<FileAttr> listDir(TreePtr root, const std::string &path) const;
+
+    /** Same as above, except that a missing path is reported as -errno rather than
+     *  thrown. Other failures still throw
+     */
+    int getEntry(const git_tree *root, const std::string &path, TreeEntryPtr &out) const;
+    int getAttr(const git_tree *root, const std::string &path, FileAttr &out) const;
+    int listDir(TreePtr root, const std::string &path, std::vector<FileAttr> &out) const;
 
     struct stat rootStat; /// Attributes of .git
+    std::unique_ptr<PathIndex> pathIndex;
+    std::unique_ptr<RepoPool> pool;
+
+    std::string metaFile; /// Empty unless `enableMetaCache` is called
+    std::shared_ptr<const MetaCache> metaCache; /// The snapshot last loaded or saved
+    std::mutex metaLock; /// Serializes saves
+
+    /** Repository handle of the calling thread, for reading objects.
+     *  Objects passed to libgit2 calls that create objects must come from `repo`
+     */
+    git_repository *reader() const;
+
+    StagingOdb *staging = nullptr; /// Owned by the odb of `repo`
+    bool refPending = false; /// With staging, the HEAD ref is only moved when objects are flushed
+
+    /** The version readers see. Writers build the next commit off to the side and
+     *  swap this pointer atomically, so readers never wait for a commit.
+     */
+    struct Published
+    {
+        git_oid commit;
+        git_oid tree;
+    };
+    std::shared_ptr<const Published> published;
+
+    std::shared_ptr<const Published> current() const;
+    void publish(const git_oid &commit, const git_oid &tree);
+    void publishHead();
+    /** Reset the index to the published tree if it differs, as a crash in the middle
+     *  of a transaction may leave it
+     */
+    void syncIndex();
+
+    std::string resolveSpec(const char *spec) const;
+    void flushStaged();
 
     static int refCount; /// Reference count of Git objects
 
@@ -103,32 +188,146 @@ private:
 
     void commit(const git_oid &blob_id, const std::string &path, const char *msg = "commit",
                 const bool executable = false);
-    void commit(const IndexPtr &index, const CommitPtr &head, const char *msg);
+    void commit(const IndexPtr &index, const CommitPtr &head, const char *msg,
+                const std::vector<Change> &changes);
+    /** Make a commit of `tree_id` on top of `head` and publish it
+     */
+    void commitTree(const git_oid &tree_id, const CommitPtr &head, const char *msg,
+                    const std::vector<Change> &changes);
+
+    /** Changes published since `begin`, to be committed as one
+     */
+    struct Transaction
+    {
+        std::vector<Change> changes;
+    };
+    std::unique_ptr<Transaction> transaction;
+
+    /** Bring `pathIndex` up to date with HEAD
+     */
+    void indexHistory();
     void commit_remove(const std::string &path, const char *msg = "commit");
 
 public:
     git_repository *repo;
-    mutable pthread_rwlock_t rwlock;
+    mutable pthread_rwlock_t rwlock; /// Serializes writers; readers do not take it
 
     /** Initialize from a .git directory
      *  @param path : Path to a .git directory
+     *  @param options : Applied when libgit2 is initialized, by the first instance
      */
-    Git(const std::string &path);
+    Git(const std::string &path, const Options &options);
+    explicit Git(const std::string &path) : Git(path, Options()) {}
 
     ~Git();
 
     void checkSig() const;
-    void dump(const std::string &path, const std::string &out_path, bool *out_executable = nullptr) const;
+
+    /** Load the indexes of all packs, and the trees of HEAD down to depth `levels`,
+     *  using `threads` threads. Their repository handles go back to the pool warm
+     */
+    void warmUp(unsigned levels, unsigned threads);
+
+    /** Hold new objects in memory and write them as packfiles on `flush`
+     */
+    void enableStaging(const StagingOdb::Config &config);
+    void flush();
+
+    /** Answer lookups and listings from the metadata snapshot inside .git, and save
+     *  one on `saveMetaCache`. See MetaCache
+     */
+    void enableMetaCache();
+    /** Snapshot the published tree, unless the snapshot is of it already
+     */
+    void saveMetaCache();
+
+    /** Blob of file `path` in HEAD, for loading into an open buffer
+     */
+    BlobPtr dump(const std::string &path, bool *out_executable = nullptr) const;
     void commit(const std::string &in_path, const std::string &path, const char *msg = "commit",
                 bool executable = false);
+    /** Commit the contents of an open file descriptor, read through `mmap`
+     */
+    void commitFd(int fd, const std::string &path, const char *msg, bool executable = false);
+    void commitBuffer(const void *data, std::size_t len, const std::string &path, const char *msg,
+                      bool executable = false);
+    /** Stream of a new blob of exactly `size` bytes into the object database, hashed
+     *  and compressed as it is written. Free it with git_odb_stream_free
+     *  @return nullptr if no backend takes streams
+     */
+    git_odb_stream *openBlob(std::size_t size);
+    /** Finalize a stream from `openBlob`, and commit the blob as `path`. Frees `stream`
+     */
+    void commitStream(git_odb_stream *stream, const std::string &path, const char *msg,
+                      bool executable = false);
+
+    /** Called with `rwlock` held before any commit, except those made by `commitBuffer`
+     */
+    std::function<void ()> beforeCommit;
+    /** Called with `rwlock` held once a commit is published, with the paths it changed
+     */
+    std::function<void (const std::vector<Change> &)> afterCommit;
     void truncate(const std::string &path, std::size_t size);
     void unlink(const std::string &path, const char *msg = "unlink");
     std::vector<FileAttr> listDir(const std::string &path) const;
     FileAttr getAttr(const std::string &path) const;
+
+    /** Lookups for the request handlers, where misses are common: a missing path is
+     *  returned as -ENOENT or -ENOTDIR without throwing or logging. Other failures
+     *  still throw `Error`
+     */
+    int listDir(const std::string &path, std::vector<FileAttr> &out) const;
+    int getAttr(const std::string &path, FileAttr &out) const;
+
+    /** Root tree readers currently see. Anything derived from it stays valid while it
+     *  is published
+     */
+    git_oid rootTree() const;
+    /** Attributes of entry `name` of tree `tree`, for resolving paths one component at
+     *  a time
+     *  @param out_id : Receives the id of the entry
+     *  @return -ENOENT if there is no such entry
+     */
+    int lookup(const git_oid &tree, const std::string &name, FileAttr &out, git_oid *out_id) const;
+    /** Names of the entries of tree `tree`
+     */
+    std::vector<std::string> names(const git_oid &tree) const;
     void chmod(const std::string &path, const bool executable);
     void rename(const std::string &oldname, const std::string &newname,
                 const std::function<void (const std::string &, const std::string &)> &cb);
     void checkout_branch(time_t timeoff);
+    /** Make `dst` a copy of file or directory `src`, sharing its objects, so nothing
+     *  is read or written but the index and the trees
+     */
+    void clone(const std::string &src, const std::string &dst);
+
+    /** Between `begin` and `commitTransaction`, changes are published as they are
+     *  made, but no commits are created. `commitTransaction` records all of them as
+     *  one commit; `abortTransaction` drops them and publishes HEAD again. There is
+     *  one transaction for the whole repository, covering changes by anyone.
+     *  @return false if a transaction is already open, or none is open, respectively
+     */
+    bool begin();
+    bool commitTransaction(const char *msg);
+    bool abortTransaction();
+    bool inTransaction() const;
+
+    /** Read-only access to historical trees. `rev` is any revision libgit2 can parse
+     */
+    std::vector<Version> listVersions() const;
+    /** Versions of a single file, from the path index
+     */
+    std::vector<Version> listVersions(const std::string &path) const;
+    /** Modification and change time of `path`, from the path index
+     */
+    void times(const std::string &path, time_t *out_mtime, time_t *out_ctime) const;
+    /** Set the modification time of `path`, until it changes again. Renames and
+     *  clones carry it along
+     */
+    void touch(const std::string &path, time_t mtime);
+    std::vector<FileAttr> listDir(const std::string &rev, const std::string &path) const;
+    FileAttr getAttr(const std::string &rev, const std::string &path) const;
+    BlobPtr blob(const std::string &rev, const std::string &path) const;
 };
 
 #undef BUILD_PTR
@@ -0,0 +1,98 @@
+#include "mangle.h"
+#include "History.h"
+
+const std::string History::DIR = "/.sfs-history";
+
+static constexpr mode_t READ_ONLY_DIR = S_IFDIR | 0555;
+static constexpr mode_t READ_ONLY_FILE = S_IFREG | 0444;
+
+bool History::match(const std::string &path)
+{
+    return path.compare(0, DIR.length(), DIR) == 0 &&
+           (path.length() == DIR.length() || path[DIR.length()] == '/');
+}
+
+History::Kind History::parse(const Git &git, const std::string &path, std::string &inner, std::string &rev)
+{
+    if (path.length() <= DIR.length() + 1)
+    {
+        inner = "/";
+        return MIRROR;
+    }
+    inner = path_mangle(path.substr(DIR.length()));
+    if (!git.listVersions(inner).empty())
+        return VERSIONS;
+
+    std::size_t pos = inner.rfind('/');
+    std::string parent = inner.substr(0, pos);
+    if (pos > 0 && !git.listVersions(parent).empty())
+    {
+        rev = Snapshot::resolve(git, path_demangle(inner.substr(pos + 1)));
+        inner = parent;
+        return VERSION;
+    }
+    return MIRROR;
+}
+
+struct stat History::getAttr(const Git &git, const std::string &path)
+{
+    std::string inner, rev;
+    struct stat st;
+    switch (parse(git, path, inner, rev))
+    {
+    case MIRROR:
+        st = git.getAttr(inner).stat;
+        if (!S_ISDIR(st.st_mode))
+            throw Git::Error(GIT_ENOTFOUND, "history: not indexed " + inner);
+        st.st_mode = READ_ONLY_DIR;
+        break;
+    case VERSIONS:
+        st = git.getAttr("/").stat;
+        st.st_mode = READ_ONLY_DIR;
+        st.st_mtime = git.listVersions(inner).front().time;
+        break;
+    case VERSION:
+        st = git.getAttr(rev, inner).stat;
+        st.st_mode = READ_ONLY_FILE;
+        break;
+    }
+    return st;
+}
+
+std::vector<Git::FileAttr> History::listDir(const Git &git, const std::string &path)
+{
+    std::string inner, rev;
+    std::vector<Git::FileAttr> list;
+    switch (parse(git, path, inner, rev))
+    {
+    case MIRROR:
+        list = git.listDir(inner);
+        for (auto &item : list)
+        {
+            item.name = path_demangle(item.name);
+            item.stat.st_mode = READ_ONLY_DIR;
+        }
+        break;
+    case VERSIONS:
+        for (const auto &v : git.listVersions(inner))
+        {
+            Git::FileAttr attr;
+            attr.name = Snapshot::name(v);
+            attr.stat.st_mode = READ_ONLY_FILE;
+            attr.stat.st_mtime = v.time;
+            list.push_back(attr);
+        }
+        break;
+    case VERSION:
+        throw Git::Error(GIT_ENOTFOUND, "history: not a directory " + path);
+    }
+    return list;
+}
+
+Snapshot *History::open(const Git &git, const std::string &path)
+{
+    std::string inner, rev;
+    if (parse(git, path, inner, rev) != VERSION)
+        throw Git::Error(GIT_ENOTFOUND, "history: not a version " + path);
+    return Snapshot::open(git, Snapshot::DIR + "/" + rev + path_demangle(inner));
+}
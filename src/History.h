@@ -0,0 +1,35 @@
+#ifndef HISTORY_H_
+#define HISTORY_H_
+
+#include <string>
+#include <vector>
+#include "Git.h"
+#include "Snapshot.h"
+
+/** Per-file version listings under a hidden directory of the mount
+ *
+ *  /.sfs-history mirrors the directories of HEAD. Each file appears as a directory
+ *  holding one read-only file per version, named like the snapshots. Listings are
+ *  answered from the path index, without walking the history.
+ */
+class History
+{
+private:
+    enum Kind { MIRROR, VERSIONS, VERSION };
+
+    /** @param inner : Set to the (mangled) path of the file or directory
+     *  @param rev : Set to the revision when the result is VERSION
+     */
+    static Kind parse(const Git &git, const std::string &path, std::string &inner, std::string &rev);
+
+public:
+    static const std::string DIR;
+
+    static bool match(const std::string &path);
+
+    static struct stat getAttr(const Git &git, const std::string &path);
+    static std::vector<Git::FileAttr> listDir(const Git &git, const std::string &path);
+    static Snapshot *open(const Git &git, const std::string &path);
+};
+
+#endif // HISTORY_H_
@@ -0,0 +1,378 @@
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include "mangle.h"
+#include "InodeTable.h"
+
+constexpr InodeTable::Inode InodeTable::ROOT;
+thread_local bool InodeTable::pinned = false;
+thread_local git_oid InodeTable::pinnedRoot;
+
+InodeTable::InodeTable(const Git &git, std::size_t negativeTrees)
+    : git(git), negative(git, negativeTrees)
+{
+    Node &root = nodes[ROOT];
+    root.parent = ROOT;
+    root.nlookup = 1; // Never forgotten
+}
+
+void InodeTable::pin()
+{
+    pinnedRoot = git.rootTree();
+    pinned = true;
+}
+
+void InodeTable::unpin()
+{
+    pinned = false;
+}
+
+void InodeTable::repin()
+{
+    if (pinned)
+        pinnedRoot = git.rootTree();
+}
+
+git_oid InodeTable::root() const
+{
+    return pinned ? pinnedRoot : git.rootTree();
+}
+
+std::string InodeTable::pathLocked(Inode ino) const
+{
+    std::string path;
+    while (ino != ROOT)
+    {
+        auto iter = nodes.find(ino);
+        if (iter == nodes.end())
+            throw Git::Error(GIT_ENOTFOUND, "inode " + std::to_string(ino) + " not found");
+        path = "/" + iter->second.name + path;
+        ino = iter->second.parent;
+    }
+    return path.empty() ? "/" : path;
+}
+
+std::string InodeTable::path(Inode ino) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return pathLocked(ino);
+}
+
+std::string InodeTable::path(Inode parent, const std::string &name) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::string dir = pathLocked(parent);
+    return (dir == "/" ? "" : dir) + "/" + name;
+}
+
+int InodeTable::resolve(Inode ino, const git_oid &root, Git::FileAttr &out, git_oid *out_id)
+{
+    Inode parent;
+    std::string name;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto iter = nodes.find(ino);
+        if (iter == nodes.end() || !iter->second.linked)
+            return -ENOENT;
+        const Node &node = iter->second;
+        if (node.cached && git_oid_equal(&node.root, &root))
+        {
+            *out_id = node.id;
+            out = node.attr;
+            return 0;
+        }
+        parent = node.parent;
+        name = node.name;
+    }
+
+    git_oid id;
+    Git::FileAttr attr;
+    if (ino == ROOT)
+    {
+        attr = git.getAttr("/");
+        id = root;
+    }
+    else
+    {
+        git_oid dir;
+        int err = resolveDir(parent, root, &dir);
+        if (err < 0)
+            return err;
+        if (pendingAttr(parent, name, attr) == 0)
+            memset(&id, 0, sizeof id); // No blob yet
+        else if ((err = git.lookup(dir, path_mangle(name), attr, &id)) < 0)
+            return err;
+    }
+    attr.stat.st_ino = ino;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = nodes.find(ino);
+    if (iter != nodes.end())
+    {
+        Node &node = iter->second;
+        node.cached = true;
+        node.root = root;
+        node.id = id;
+        node.attr = attr;
+    }
+    *out_id = id;
+    out = attr;
+    return 0;
+}
+
+int InodeTable::resolveDir(Inode ino, const git_oid &root, git_oid *out_id)
+{
+    Git::FileAttr attr;
+    int err = resolve(ino, root, attr, out_id);
+    if (err < 0)
+        return err;
+    return S_ISDIR(attr.stat.st_mode) ? 0 : -ENOTDIR;
+}
+
+int InodeTable::pendingAttr(Inode parent, const std::string &name, Git::FileAttr &out) const
+{
+    bool executable;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto iter = pending.find(std::make_pair(parent, name));
+        if (iter == pending.end())
+            return -ENOENT;
+        executable = iter->second;
+    }
+    Git::FileAttr root = git.getAttr("/");
+    out = Git::FileAttr();
+    out.name = path_mangle(name);
+    out.stat.st_mode = S_IFREG | (executable ? 0755 : 0644);
+    out.stat.st_uid = root.stat.st_uid;
+    out.stat.st_gid = root.stat.st_gid;
+    out.stat.st_nlink = 1;
+    return 0;
+}
+
+int InodeTable::getAttr(Inode ino, Git::FileAttr &out, git_oid *out_id)
+{
+    git_oid id;
+    return resolve(ino, root(), out, out_id ? out_id : &id);
+}
+
+bool InodeTable::absent(Inode parent, const std::string &name)
+{
+    git_oid dir;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto iter = nodes.find(parent);
+        if (iter == nodes.end())
+            return false;
+        if (pending.count(std::make_pair(parent, name)))
+            return false; // Not in any tree yet
+        const Node &node = iter->second;
+        git_oid root = this->root();
+        if (!node.cached || !git_oid_equal(&node.root, &root) || !S_ISDIR(node.attr.stat.st_mode))
+            return false; // Not worth resolving here
+        dir = node.id;
+    }
+    return negative.absent(dir, path_mangle(name));
+}
+
+int InodeTable::lookup(Inode parent, const std::string &name, Inode *out_ino, Git::FileAttr *out_attr)
+{
+    git_oid root, id;
+    Git::FileAttr attr;
+    if (out_attr)
+    {
+        root = this->root();
+        git_oid dir;
+        int err = resolveDir(parent, root, &dir);
+        if (err < 0)
+            return err;
+        if (pendingAttr(parent, name, attr) == 0)
+            memset(&id, 0, sizeof id); // No blob yet
+        else if ((err = git.lookup(dir, path_mangle(name), attr, &id)) < 0)
+        {
+            if (err == -ENOENT)
+                negative.miss(dir);
+            return err;
+        }
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    Inode ino;
+    auto key = std::make_pair(parent, name);
+    auto iter = children.find(key);
+    if (iter == children.end())
+    {
+        ino = next++;
+        Node &node = nodes[ino];
+        node.parent = parent;
+        node.name = name;
+        children[key] = ino;
+    }
+    else
+    {
+        ino = iter->second;
+    }
+    Node &node = nodes[ino];
+    node.nlookup++;
+    if (out_attr)
+    {
+        attr.stat.st_ino = ino;
+        node.cached = true;
+        node.root = root;
+        node.id = id;
+        node.attr = attr;
+        *out_attr = attr;
+    }
+    *out_ino = ino;
+    return 0;
+}
+
+bool InodeTable::keepCache(Inode ino)
+{
+    git_oid id;
+    Git::FileAttr attr;
+    if (resolve(ino, root(), attr, &id) < 0)
+        return false;
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = nodes.find(ino);
+    if (iter == nodes.end())
+        return false;
+    Node &node = iter->second;
+    bool keep = node.opened && git_oid_equal(&node.pages, &id);
+    node.opened = true;
+    node.pages = id;
+    return keep;
+}
+
+bool InodeTable::find(const std::string &path, Inode *out_parent, Inode *out_ino, std::string *out_name) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Inode ino = ROOT;
+    std::size_t begin = 1;
+    while (true)
+    {
+        std::size_t end = path.find('/', begin);
+        std::string name = path.substr(begin, end == std::string::npos ? std::string::npos : end - begin);
+        auto iter = children.find(std::make_pair(ino, name));
+        if (end == std::string::npos)
+        {
+            *out_parent = ino;
+            *out_ino = iter == children.end() ? 0 : iter->second;
+            *out_name = name;
+            return true;
+        }
+        if (iter == children.end())
+            return false;
+        ino = iter->second;
+        begin = end + 1;
+    }
+}
+
+void InodeTable::forget(Inode ino, std::uint64_t nlookup)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = nodes.find(ino);
+    if (iter == nodes.end() || ino == ROOT)
+        return;
+    Node &node = iter->second;
+    node.nlookup -= std::min(nlookup, node.nlookup);
+    if (node.nlookup > 0)
+        return;
+    auto child = children.find(std::make_pair(node.parent, node.name));
+    if (child != children.end() && child->second == ino)
+        children.erase(child);
+    nodes.erase(iter);
+}
+
+void InodeTable::unlink(Inode parent, const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = children.find(std::make_pair(parent, name));
+    if (iter == children.end())
+        return;
+    nodes[iter->second].linked = false;
+    children.erase(iter);
+    pending.erase(std::make_pair(parent, name));
+}
+
+void InodeTable::rename(Inode parent, const std::string &name, Inode newparent, const std::string &newname)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = children.find(std::make_pair(parent, name));
+    if (iter == children.end())
+        return;
+    Inode ino = iter->second;
+    children.erase(iter);
+
+    auto key = std::make_pair(newparent, newname);
+    auto replaced = children.find(key);
+    if (replaced != children.end())
+        nodes[replaced->second].linked = false;
+    children[key] = ino;
+
+    Node &node = nodes[ino];
+    node.parent = newparent;
+    node.name = newname;
+    node.cached = false;
+
+    auto created = pending.find(std::make_pair(parent, name));
+    if (created != pending.end())
+    {
+        pending[key] = created->second;
+        pending.erase(created);
+    }
+}
+
+void InodeTable::create(Inode parent, const std::string &name, bool executable)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    pending[std::make_pair(parent, name)] = executable;
+}
+
+void InodeTable::chmod(Inode ino, bool executable)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = nodes.find(ino);
+    if (iter == nodes.end())
+        return;
+    auto created = pending.find(std::make_pair(iter->second.parent, iter->second.name));
+    if (created != pending.end())
+    {
+        created->second = executable;
+        iter->second.cached = false;
+    }
+}
+
+void InodeTable::committed(const std::vector<Git::Change> &changes)
+{
+    Inode parent, ino;
+    std::string name;
+    for (const auto &change : changes)
+    {
+        std::string path = path_demangle(change.path);
+        if (path != "" && find(path, &parent, &ino, &name))
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.erase(std::make_pair(parent, name));
+        }
+    }
+}
+
+std::vector<std::string> InodeTable::pendingNames(Inode parent) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::string> names;
+    for (auto iter = pending.lower_bound(std::make_pair(parent, std::string()));
+         iter != pending.end() && iter->first.first == parent; iter++)
+        names.push_back(iter->first.second);
+    return names;
+}
+
+bool InodeTable::hasPending(Inode parent, const std::string &name) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto child = children.find(std::make_pair(parent, name));
+    if (child == children.end())
+        return false;
+    auto iter = pending.lower_bound(std::make_pair(child->second, std::string()));
+    return iter != pending.end() && iter->first.first == child->second;
+}
@@ -0,0 +1,144 @@
+#ifndef INODE_TABLE_H_
+#define INODE_TABLE_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+#include "Git.h"
+#include "NegativeCache.h"
+
+/** Inode numbers handed to the kernel, and the tree entries behind them
+ *
+ *  Every inode links to its parent by number and to its entry by name, so a rename
+ *  or unlink only touches one link. The attributes and entry id of each inode are
+ *  cached together with the root tree they were resolved in, and are resolved from
+ *  the cached parent one component at a time once the tree changes.
+ *
+ *  Files created but not committed yet are kept in an overlay, and are found there
+ *  when the tree has no such entry, until a commit adds them.
+ */
+class InodeTable
+{
+public:
+    using Inode = std::uint64_t;
+    static constexpr Inode ROOT = 1; /// Same as FUSE_ROOT_ID
+
+private:
+    struct Node
+    {
+        Inode parent;
+        std::string name; /// As the kernel sees it, not mangled
+        std::uint64_t nlookup = 0; /// References held by the kernel
+        bool linked = true; /// Whether the entry still exists under `name`
+        bool cached = false;
+        git_oid root; /// Tree the cache was resolved in
+        git_oid id;
+        Git::FileAttr attr;
+        bool opened = false;
+        git_oid pages; /// Blob the kernel may hold pages of, since the last open
+    };
+
+    const Git &git;
+    NegativeCache negative;
+    std::unordered_map<Inode, Node> nodes;
+    std::map<std::pair<Inode, std::string>, Inode> children;
+    std::map<std::pair<Inode, std::string>, bool> pending; /// Whether executable
+    Inode next = ROOT + 1;
+    mutable std::mutex lock;
+
+    static thread_local bool pinned;
+    static thread_local git_oid pinnedRoot;
+
+    /** Root tree to resolve in: the pinned one, if any, or the published one
+     */
+    git_oid root() const;
+    std::string pathLocked(Inode ino) const;
+    /** @return -ENOENT if `ino` is unlinked or missing in `root`
+     */
+    int resolve(Inode ino, const git_oid &root, Git::FileAttr &out, git_oid *out_id);
+    /** Same as `resolve`, returning -ENOTDIR if `ino` is not a directory
+     */
+    int resolveDir(Inode ino, const git_oid &root, git_oid *out_id);
+    /** Attributes of a pending file, which is still empty as far as the tree knows
+     *  @return -ENOENT if there is none
+     */
+    int pendingAttr(Inode parent, const std::string &name, Git::FileAttr &out) const;
+
+public:
+    /** @param negativeTrees : Trees to keep summaries of names for, see NegativeCache
+     */
+    InodeTable(const Git &git, std::size_t negativeTrees);
+
+    /** Resolve everything on this thread in the tree published now, until `unpin`
+     *  Saves loading the published tree for every request of a batch.
+     */
+    void pin();
+    void unpin();
+    /** Move the pin of this thread, if any, to the tree published now. Called after
+     *  this thread commits, so that it sees its own changes
+     */
+    void repin();
+
+    /** Path of `ino` in the mount, as the kernel sees it. Unlinked inodes keep the
+     *  path they were last known by
+     */
+    std::string path(Inode ino) const;
+    std::string path(Inode parent, const std::string &name) const;
+
+    /** Attributes of `ino` in the published tree, with `st_ino` set
+     *  @param out_id : If not null, receives the id of its object, zero if it has none
+     *                  yet
+     *  @return -ENOENT if it no longer exists. Only unexpected failures throw
+     */
+    int getAttr(Inode ino, Git::FileAttr &out, git_oid *out_id = nullptr);
+
+    /** @return true if `parent` certainly has no entry `name`. Cheap, and never throws
+     */
+    bool absent(Inode parent, const std::string &name);
+
+    /** Count a kernel reference to entry `name` of `parent`, assigning an inode number
+     *  if it has none
+     *  @param out_attr : If not null, the entry is resolved in the published tree
+     *                    first, and its attributes are stored here
+     *  @return -ENOENT or -ENOTDIR if the entry cannot be resolved, in which case no
+     *          reference is counted
+     */
+    int lookup(Inode parent, const std::string &name, Inode *out_ino, Git::FileAttr *out_attr = nullptr);
+
+    /** Drop `nlookup` kernel references. An inode without any is removed
+     */
+    void forget(Inode ino, std::uint64_t nlookup);
+
+    /** Whether the kernel may keep the pages it caches of `ino` on this open, i.e.
+     *  the blob is still the one of the last open
+     */
+    bool keepCache(Inode ino);
+
+    /** Find the inode of a path, and of its parent
+     *  @return false if the parent has no inode. `*out_ino` is 0 if only the parent has
+     */
+    bool find(const std::string &path, Inode *out_parent, Inode *out_ino, std::string *out_name) const;
+
+    void unlink(Inode parent, const std::string &name);
+    void rename(Inode parent, const std::string &name, Inode newparent, const std::string &newname);
+
+    /** Add a created file to the overlay, to be found until it is committed
+     */
+    void create(Inode parent, const std::string &name, bool executable);
+    /** Mode change of `ino`, which matters only while it is pending
+     */
+    void chmod(Inode ino, bool executable);
+    /** Drop the files `changes` committed from the overlay
+     */
+    void committed(const std::vector<Git::Change> &changes);
+    /** Names of the pending files in directory `parent`
+     */
+    std::vector<std::string> pendingNames(Inode parent) const;
+    /** Whether entry `name` of `parent` is a directory with pending files in it
+     */
+    bool hasPending(Inode parent, const std::string &name) const;
+};
+
+#endif // INODE_TABLE_H_
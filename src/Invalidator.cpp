@@ -0,0 +1,61 @@
+#define FUSE_USE_VERSION 26
+#define _FILE_OFFSET_BITS 64
+
+#include <fuse_lowlevel.h>
+#include "utils.h"
+#include "mangle.h"
+#include "InodeTable.h"
+#include "Invalidator.h"
+
+InodeTable *Invalidator::inodes = nullptr;
+struct fuse_chan *Invalidator::channel = nullptr;
+std::deque<Git::Change> Invalidator::queue;
+std::mutex Invalidator::lock;
+std::condition_variable Invalidator::wake;
+std::thread Invalidator::invalidate_thread;
+
+void Invalidator::notify(const std::vector<Git::Change> &changes)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        queue.insert(queue.end(), changes.begin(), changes.end());
+    }
+    wake.notify_one();
+}
+
+void Invalidator::invalidate(const Git::Change &change)
+{
+    std::string path = path_demangle(change.path);
+    InodeTable::Inode parent, ino;
+    std::string name;
+    if (path == "" || !inodes->find(path, &parent, &ino, &name))
+        return; // The kernel has never looked it up
+    if (change.removed || !ino) // A name without an inode may be cached as missing
+        fuse_lowlevel_notify_inval_entry(channel, parent, name.c_str(), name.length());
+    else
+        fuse_lowlevel_notify_inval_inode(channel, ino, 0, 0);
+}
+
+void Invalidator::invalidate_loop()
+{
+    while (true)
+    {
+        std::deque<Git::Change> batch;
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            wake.wait(guard, [] () { return !queue.empty(); });
+            batch.swap(queue);
+        }
+        for (const auto &change : batch)
+            invalidate(change);
+        LOG << "invalidated " << batch.size() << " entries" << std::endl;
+    }
+}
+
+void Invalidator::start(InodeTable &inodes, struct fuse_chan *channel)
+{
+    Invalidator::inodes = &inodes;
+    Invalidator::channel = channel;
+    invalidate_thread = std::thread(invalidate_loop);
+    invalidate_thread.detach();
+}
@@ -0,0 +1,41 @@
+#ifndef INVALIDATOR_H_
+#define INVALIDATOR_H_
+
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "Git.h"
+
+class InodeTable;
+struct fuse_chan;
+
+/** Background thread telling the kernel to drop what it caches of changed entries
+ *
+ *  Commits queue the paths they change. Notifications are sent from a thread of their
+ *  own, because sending one while a request on the same inode is being handled may
+ *  deadlock the kernel.
+ */
+class Invalidator
+{
+private:
+    static InodeTable *inodes;
+    static struct fuse_chan *channel;
+    static std::deque<Git::Change> queue;
+    static std::mutex lock;
+    static std::condition_variable wake;
+    static std::thread invalidate_thread;
+
+    static void invalidate_loop();
+    static void invalidate(const Git::Change &change);
+
+public:
+    static void start(InodeTable &inodes, struct fuse_chan *channel);
+
+    /** Called on every commit with the (mangled) paths it changed
+     */
+    static void notify(const std::vector<Git::Change> &changes);
+};
+
+#endif // INVALIDATOR_H_
@@ -0,0 +1,189 @@
+#include <cerrno>
+#include <cstring>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <algorithm>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "IoRing.h"
+#ifdef SFS_IO_URING
+#include <liburing.h>
+#endif
+
+constexpr std::size_t IoRing::CHUNK;
+bool IoRing::enabled = false;
+unsigned IoRing::depth = 32;
+
+static ssize_t fallbackWrite(int fd, const char *buf, std::size_t size, off_t offset)
+{
+    std::size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            return -errno;
+        }
+        done += n;
+    }
+    return done;
+}
+
+static ssize_t fallbackCopy(int in, int out, std::size_t size)
+{
+    std::vector<char> buf(IoRing::CHUNK);
+    std::size_t done = 0;
+    while (done < size)
+    {
+        ssize_t n = pread(in, buf.data(), std::min(buf.size(), size - done), done);
+        if (n < 0) return -errno;
+        if (n == 0) break;
+        ssize_t ret = fallbackWrite(out, buf.data(), n, done);
+        if (ret < 0) return ret;
+        done += n;
+    }
+    return done;
+}
+
+#ifdef SFS_IO_URING
+/** Ring of a thread, with one registered buffer of `CHUNK` bytes per entry
+ */
+struct Ring
+{
+    io_uring ring;
+    std::vector<char> buffers;
+    bool ok = false;
+
+    explicit Ring(unsigned depth) : buffers(depth * IoRing::CHUNK)
+    {
+        int err = io_uring_queue_init(depth, &ring, 0);
+        if (err < 0)
+        {
+            LOG << "io_uring_queue_init: " << strerror(-err) << std::endl;
+            return;
+        }
+        std::vector<iovec> iov(depth);
+        for (unsigned i = 0; i < depth; i++)
+            iov[i] = {buffers.data() + i * IoRing::CHUNK, IoRing::CHUNK};
+        if ((err = io_uring_register_buffers(&ring, iov.data(), depth)) < 0)
+        {
+            LOG << "io_uring_register_buffers: " << strerror(-err) << std::endl;
+            io_uring_queue_exit(&ring);
+            return;
+        }
+        ok = true;
+    }
+
+    ~Ring()
+    {
+        if (ok) io_uring_queue_exit(&ring);
+    }
+};
+
+static Ring *threadRing(unsigned depth)
+{
+    thread_local std::unique_ptr<Ring> ring(new Ring(depth));
+    return ring->ok ? ring.get() : nullptr;
+}
+
+/** Queue an operation expecting to transfer `len` bytes
+ */
+static io_uring_sqe *queue(Ring *ring, std::size_t len)
+{
+    io_uring_sqe *sqe = io_uring_get_sqe(&ring->ring);
+    io_uring_sqe_set_data(sqe, (void *)(uintptr_t)len);
+    return sqe;
+}
+
+/** Submit what is queued and reap `count` completions
+ *  @return false if any of them failed or came short
+ */
+static bool complete(Ring *ring, unsigned count)
+{
+    bool ok = io_uring_submit(&ring->ring) >= 0;
+    for (unsigned i = 0; i < count; i++)
+    {
+        io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&ring->ring, &cqe) < 0)
+            return false;
+        if (cqe->res < 0 || (uintptr_t)cqe->res != (uintptr_t)io_uring_cqe_get_data(cqe))
+            ok = false;
+        io_uring_cqe_seen(&ring->ring, cqe);
+    }
+    return ok;
+}
+#endif
+
+void IoRing::enable(unsigned depth)
+{
+#ifdef SFS_IO_URING
+    IoRing::depth = std::max(depth, 2u); // A copy takes two entries per chunk
+    enabled = true;
+#else
+    UNUSED(depth);
+    LOG << "io_uring: not built with SFS_IO_URING, using plain syscalls" << std::endl;
+#endif
+}
+
+ssize_t IoRing::write(int fd, const void *buf, std::size_t size, off_t offset)
+{
+#ifdef SFS_IO_URING
+    Ring *ring = enabled && size > CHUNK ? threadRing(depth) : nullptr; // A single chunk is not worth it
+    if (ring)
+    {
+        const char *data = (const char *)buf;
+        std::size_t done = 0;
+        bool ok = true;
+        while (ok && done < size)
+        {
+            unsigned count = 0;
+            for (; count < depth && done < size; count++)
+            {
+                std::size_t len = std::min(CHUNK, size - done);
+                io_uring_prep_write(queue(ring, len), fd, data + done, len, offset + done);
+                done += len;
+            }
+            ok = complete(ring, count);
+        }
+        if (ok)
+            return size;
+        LOG << "io_uring: write failed, retrying with pwrite" << std::endl;
+    }
+#endif
+    return fallbackWrite(fd, (const char *)buf, size, offset);
+}
+
+ssize_t IoRing::copy(int in, int out, std::size_t size)
+{
+#ifdef SFS_IO_URING
+    Ring *ring = enabled && size > CHUNK ? threadRing(depth) : nullptr;
+    if (ring)
+    {
+        std::size_t done = 0;
+        bool ok = true;
+        while (ok && done < size)
+        {
+            unsigned count = 0;
+            for (unsigned i = 0; i < depth / 2 && done < size; i++)
+            {
+                std::size_t len = std::min(CHUNK, size - done);
+                char *chunk = ring->buffers.data() + i * CHUNK;
+                io_uring_sqe *sqe = queue(ring, len);
+                io_uring_prep_read_fixed(sqe, in, chunk, len, done, i);
+                sqe->flags |= IOSQE_IO_LINK; // Write the chunk once it is read
+                io_uring_prep_write_fixed(queue(ring, len), out, chunk, len, done, i);
+                done += len;
+                count += 2;
+            }
+            ok = complete(ring, count);
+        }
+        if (ok)
+            return size;
+        LOG << "io_uring: copy failed, retrying with pread/pwrite" << std::endl;
+    }
+#endif
+    return fallbackCopy(in, out, size);
+}
@@ -0,0 +1,38 @@
+#ifndef IO_RING_H_
+#define IO_RING_H_
+
+#include <cstddef>
+#include <sys/types.h>
+
+/** Bulk file I/O of open buffers, batched through io_uring
+ *
+ *  Large loads and spills are split into chunks that are submitted together, and
+ *  copies go through buffers registered with the ring. Every thread gets a ring of
+ *  its own on first use. Without io_uring (built without `SFS_IO_URING`, not enabled,
+ *  or not supported by the kernel), the same calls fall back to pread(2)/pwrite(2).
+ */
+class IoRing
+{
+private:
+    static bool enabled;
+    static unsigned depth;
+
+public:
+    static constexpr std::size_t CHUNK = 128 << 10;
+
+    /** @param depth : Submission queue entries of each ring
+     */
+    static void enable(unsigned depth);
+
+    /** Write all `size` bytes of `buf` to `fd` at `offset`
+     *  @return -errno on failure
+     */
+    static ssize_t write(int fd, const void *buf, std::size_t size, off_t offset);
+
+    /** Copy the first `size` bytes of `in` to `out`
+     *  @return Bytes copied, or -errno on failure
+     */
+    static ssize_t copy(int in, int out, std::size_t size);
+};
+
+#endif // IO_RING_H_
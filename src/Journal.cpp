@@ -0,0 +1,268 @@
+#include <cstdio>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include "Git.h"
+#include "utils.h"
+#include "Journal.h"
+
+/** On-disk layout: a header, then records until the end of the file. A record whose
+ *  checksum does not match (a torn write) ends the journal.
+ */
+struct JournalHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t foldedSeq; /// Records up to this one are in the history
+};
+
+struct RecordHeader
+{
+    uint32_t magic;
+    uint32_t crc; /// Over the rest of the header, the path and the data
+    uint64_t seq;
+    uint64_t offset;
+    uint32_t pathLen;
+    uint32_t dataLen;
+};
+
+static constexpr uint32_t JOURNAL_MAGIC = 0x4a534653; // "SFSJ"
+static constexpr uint32_t RECORD_MAGIC = 0x52534653; // "SFSR"
+static constexpr uint32_t JOURNAL_VERSION = 1;
+
+static uint32_t crc32(uint32_t crc, const void *data, std::size_t len)
+{
+    static uint32_t table[256];
+    static bool init = false;
+    if (!init)
+    {
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        init = true;
+    }
+    const unsigned char *p = (const unsigned char *)data;
+    crc = ~crc;
+    while (len--)
+        crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static uint32_t recordCrc(const RecordHeader &h, const char *path, const char *data)
+{
+    uint32_t crc = crc32(0, &h.seq, sizeof h - offsetof(RecordHeader, seq));
+    crc = crc32(crc, path, h.pathLen);
+    return crc32(crc, data, h.dataLen);
+}
+
+Journal::Journal(const std::string &file)
+    : file(file)
+{
+    crc32(0, nullptr, 0); // Build the table before threads start
+    fd = open(file.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+    {
+        perror("open");
+        exit(1);
+    }
+    load();
+}
+
+Journal::~Journal()
+{
+    if (fd >= 0)
+        close(fd);
+}
+
+void Journal::writeHeader()
+{
+    JournalHeader h = { JOURNAL_MAGIC, JOURNAL_VERSION, foldedSeq };
+    if (pwrite(fd, &h, sizeof h, 0) != sizeof h || fdatasync(fd) < 0)
+        perror("journal");
+}
+
+void Journal::load()
+{
+    JournalHeader h;
+    if (pread(fd, &h, sizeof h, 0) != sizeof h || h.magic != JOURNAL_MAGIC || h.version != JOURNAL_VERSION)
+    {
+        // New or unusable journal
+        if (ftruncate(fd, 0) < 0)
+            perror("ftruncate");
+        writeHeader();
+        end = sizeof h;
+        return;
+    }
+    foldedSeq = h.foldedSeq;
+    nextSeq = foldedSeq + 1;
+
+    off_t pos = sizeof h;
+    RecordHeader r;
+    while (pread(fd, &r, sizeof r, pos) == sizeof r && r.magic == RECORD_MAGIC)
+    {
+        Record record;
+        record.seq = r.seq;
+        record.offset = r.offset;
+        record.path.resize(r.pathLen);
+        record.data.resize(r.dataLen);
+        if (pread(fd, &record.path[0], r.pathLen, pos + sizeof r) != r.pathLen ||
+            pread(fd, &record.data[0], r.dataLen, pos + sizeof r + r.pathLen) != r.dataLen ||
+            recordCrc(r, record.path.data(), record.data.data()) != r.crc)
+            break;
+        pos += sizeof r + r.pathLen + r.dataLen;
+        if (record.seq <= foldedSeq)
+            continue;
+        nextSeq = record.seq + 1;
+        pendingPaths[record.path]++;
+        pending.push_back(std::move(record));
+    }
+    // Drop a torn tail, so that new records follow valid ones
+    if (ftruncate(fd, pos) < 0)
+        perror("ftruncate");
+    end = pos;
+    LOG << "journal: " << pending.size() << " writes to replay" << std::endl;
+}
+
+int Journal::append(const std::string &path, uint64_t offset, const char *buf, std::size_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Record record;
+    record.seq = nextSeq++;
+    record.path = path;
+    record.offset = offset;
+    record.data.assign(buf, size);
+
+    RecordHeader r;
+    r.magic = RECORD_MAGIC;
+    r.seq = record.seq;
+    r.offset = offset;
+    r.pathLen = path.length();
+    r.dataLen = size;
+    r.crc = recordCrc(r, path.data(), buf);
+    struct iovec iov[3] = {
+        { &r, sizeof r },
+        { const_cast<char *>(path.data()), path.length() },
+        { const_cast<char *>(buf), size },
+    };
+    ssize_t total = sizeof r + path.length() + size;
+    if (pwritev(fd, iov, 3, end) != total)
+        return errno ? -errno : -EIO;
+    end += total;
+
+    pendingPaths[path]++;
+    pending.push_back(std::move(record));
+    return 0;
+}
+
+bool Journal::dirty(const std::string &path)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return pendingPaths.count(path) > 0;
+}
+
+void Journal::fold(Git &git)
+{
+    std::deque<Record> batch;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        batch.swap(pending);
+    }
+    if (batch.empty()) return;
+
+    // Contents being folded, so a file is read from the history once per batch
+    std::unordered_map<std::string, std::pair<std::string, bool> > files;
+    std::size_t folded = 0;
+    try
+    {
+        for (; folded < batch.size(); folded++)
+            foldOne(git, batch[folded], files);
+    }
+    catch (const Git::Error &e)
+    {
+        // Keep the rest for the next attempt; they are still in the file as well
+        std::lock_guard<std::mutex> guard(lock);
+        pending.insert(pending.begin(), batch.begin() + folded, batch.end());
+        batch.erase(batch.begin() + folded, batch.end());
+        markFolded(batch);
+        throw;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    markFolded(batch);
+}
+
+void Journal::markFolded(const std::deque<Record> &batch)
+{
+    if (batch.empty()) return;
+    for (const Record &record : batch)
+        if (--pendingPaths[record.path] == 0)
+            pendingPaths.erase(record.path);
+    foldedSeq = batch.back().seq;
+    writeHeader();
+    if (pending.empty())
+    {
+        if (ftruncate(fd, sizeof(JournalHeader)) < 0)
+            perror("ftruncate");
+        end = sizeof(JournalHeader);
+    }
+}
+
+void Journal::foldOne(Git &git, const Record &record,
+                      std::unordered_map<std::string, std::pair<std::string, bool> > &files)
+{
+    auto iter = files.find(record.path);
+    if (iter == files.end())
+    {
+        std::pair<std::string, bool> file("", false);
+        try
+        {
+            Git::BlobPtr blob = git.blob("HEAD", record.path);
+            file.first.assign((const char *)git_blob_rawcontent(blob.get()), git_blob_rawsize(blob.get()));
+            file.second = git.getAttr(record.path).stat.st_mode & S_IXUSR;
+        }
+        catch (const Git::Error &e)
+        {
+            if (e.error() != GIT_ENOTFOUND)
+                throw;
+        }
+        iter = files.emplace(record.path, std::move(file)).first;
+    }
+    std::string &content = iter->second.first;
+    if (content.length() < record.offset + record.data.length())
+        content.resize(record.offset + record.data.length(), '\0');
+    content.replace(record.offset, record.data.length(), record.data);
+    git.commitBuffer(content.data(), content.length(), record.path, "write", iter->second.second);
+}
+
+void Journal::journal_loop(Git *git, int interval)
+{
+    while (true)
+    {
+        usleep(interval * 1000);
+        if (fdatasync(fd) < 0)
+            perror("fdatasync");
+        try
+        {
+            RWlock mlock(git->rwlock);
+            fold(*git);
+        }
+        catch (const Git::Error &e)
+        {
+            LOG << e.what() << std::endl;
+        }
+    }
+}
+
+void Journal::start(Git &git, int interval)
+{
+    journal_thread = std::thread(&Journal::journal_loop, this, &git, interval);
+    journal_thread.detach();
+}
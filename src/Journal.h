@@ -0,0 +1,73 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <mutex>
+#include <deque>
+#include <string>
+#include <thread>
+#include <cstdint>
+#include <sys/types.h>
+#include <unordered_map>
+
+class Git;
+
+/** Write-ahead journal for `commit_on_write`
+ *
+ *  Every write is appended to a checksummed journal inside .git and acknowledged
+ *  right away. The journal is fsynced in batches, and folded into one commit per
+ *  write by a background thread, or before any other commit so history keeps the
+ *  order of operations. Records not folded when SFS stops are replayed at the
+ *  next mount.
+ */
+class Journal
+{
+private:
+    struct Record
+    {
+        uint64_t seq;
+        std::string path;
+        uint64_t offset;
+        std::string data;
+    };
+
+    std::string file;
+    int fd = -1;
+    off_t end = 0; /// Where the next record goes. Not O_APPEND, which would move the header
+    uint64_t nextSeq = 1;
+    uint64_t foldedSeq = 0;
+    std::deque<Record> pending;
+    std::unordered_map<std::string, int> pendingPaths; /// Records not committed yet, by path
+    std::mutex lock;
+    std::thread journal_thread;
+
+    void writeHeader();
+    void load();
+    void foldOne(Git &git, const Record &record,
+                 std::unordered_map<std::string, std::pair<std::string, bool> > &files);
+    /** Call with `lock` held */
+    void markFolded(const std::deque<Record> &batch);
+    void journal_loop(Git *git, int interval);
+
+public:
+    explicit Journal(const std::string &file);
+    ~Journal();
+
+    /** Append a write. Thread-safe and does not take `Git::rwlock`
+     *  @return 0 or -errno
+     */
+    int append(const std::string &path, uint64_t offset, const char *buf, std::size_t size);
+
+    /** Whether `path` has writes not committed yet
+     */
+    bool dirty(const std::string &path);
+
+    /** Commit all appended writes, one commit each. Call with `Git::rwlock` held
+     */
+    void fold(Git &git);
+
+    /** Sync and fold every `interval` milliseconds in the background
+     */
+    void start(Git &git, int interval);
+};
+
+#endif // JOURNAL_H_
@@ -0,0 +1,158 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "MetaCache.h"
+
+constexpr const char MetaCache::MAGIC[8];
+
+MetaCache::MetaCache(const std::string &file)
+{
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (std::size_t)st.st_size < sizeof(Header))
+    {
+        close(fd);
+        return;
+    }
+    void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping stays
+    if (p == MAP_FAILED)
+    {
+        perror("mmap");
+        return;
+    }
+    map = p;
+    mapSize = st.st_size;
+
+    const Header *h = (const Header *)map;
+    std::size_t end = sizeof(Header) + h->count * sizeof(Record);
+    if (memcmp(h->magic, MAGIC, sizeof MAGIC) != 0 || h->count > mapSize / sizeof(Record) || end > mapSize)
+    {
+        LOG << "meta cache: ignoring malformed " << file << std::endl;
+        return;
+    }
+    header = h;
+    records = (const Record *)(header + 1);
+    names = (const char *)map + end;
+    namesSize = mapSize - end;
+    LOG << "meta cache: " << header->count << " entries mapped" << std::endl;
+}
+
+MetaCache::~MetaCache()
+{
+    if (map)
+        munmap(map, mapSize);
+}
+
+void MetaCache::range(const git_oid &dir, const Record **out_begin, const Record **out_end) const
+{
+    const Record *begin = records, *end = records + (header ? header->count : 0);
+    auto less = [] (const Record &r, const git_oid &id) { return git_oid_cmp(&r.dir, &id) < 0; };
+    auto greater = [] (const git_oid &id, const Record &r) { return git_oid_cmp(&id, &r.dir) < 0; };
+    *out_begin = std::lower_bound(begin, end, dir, less);
+    *out_end = std::upper_bound(*out_begin, end, dir, greater);
+}
+
+bool MetaCache::entry(const Record &r, Entry &out) const
+{
+    if (r.nameOff > namesSize || r.nameLen > namesSize - r.nameOff)
+        return false;
+    out.name.assign(names + r.nameOff, r.nameLen);
+    out.id = r.id;
+    out.mode = (git_filemode_t)r.mode;
+    out.size = r.size;
+    return true;
+}
+
+bool MetaCache::list(const git_oid &dir, std::vector<Entry> &out) const
+{
+    const Record *begin, *end;
+    range(dir, &begin, &end);
+    if (begin == end)
+        return false;
+    out.resize(end - begin);
+    for (std::size_t i = 0; begin + i < end; i++)
+        if (!entry(begin[i], out[i]))
+            return false;
+    return true;
+}
+
+int MetaCache::find(const git_oid &dir, const std::string &name, Entry &out) const
+{
+    const Record *begin, *end;
+    range(dir, &begin, &end);
+    if (begin == end)
+        return 1;
+    // Names are sorted bytewise within a tree
+    while (begin < end)
+    {
+        const Record *mid = begin + (end - begin) / 2;
+        if (!entry(*mid, out))
+            return 1;
+        int cmp = out.name.compare(name);
+        if (cmp == 0)
+            return 0;
+        if (cmp < 0)
+            begin = mid + 1;
+        else
+            end = mid;
+    }
+    return -ENOENT;
+}
+
+bool MetaCache::save(const std::string &file, const git_oid &root, std::vector<Item> items)
+{
+    std::sort(items.begin(), items.end(), [] (const Item &a, const Item &b)
+    {
+        int cmp = git_oid_cmp(&a.dir, &b.dir);
+        return cmp != 0 ? cmp < 0 : a.entry.name < b.entry.name;
+    });
+
+    std::string tmp = file + ".tmp";
+    FILE *out = fopen(tmp.c_str(), "wb");
+    if (!out)
+    {
+        perror("fopen");
+        return false;
+    }
+    Header h;
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, MAGIC, sizeof MAGIC);
+    h.root = root;
+    h.count = items.size();
+    bool ok = fwrite(&h, sizeof h, 1, out) == 1;
+    std::uint64_t off = 0;
+    for (std::size_t i = 0; ok && i < items.size(); i++)
+    {
+        const Entry &e = items[i].entry;
+        Record r;
+        memset(&r, 0, sizeof r);
+        r.dir = items[i].dir;
+        r.id = e.id;
+        r.mode = e.mode;
+        r.nameLen = e.name.length();
+        r.nameOff = off;
+        r.size = e.size;
+        off += e.name.length();
+        ok = fwrite(&r, sizeof r, 1, out) == 1;
+    }
+    for (std::size_t i = 0; ok && i < items.size(); i++)
+        ok = fwrite(items[i].entry.name.data(), 1, items[i].entry.name.length(), out) == items[i].entry.name.length();
+    if (fclose(out) != 0)
+        ok = false;
+    if (!ok || rename(tmp.c_str(), file.c_str()) < 0)
+    {
+        LOG << "meta cache: cannot write " << file << ": " << strerror(errno) << std::endl;
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
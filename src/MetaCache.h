@@ -0,0 +1,99 @@
+#ifndef META_CACHE_H_
+#define META_CACHE_H_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <git2.h>
+
+/** Mode, size and id of the entries of every tree below a root, saved across mounts
+ *
+ *  The snapshot file holds one fixed-size record per tree entry, sorted by the id of
+ *  the tree and then by name, followed by the names. It is mapped read-only, so only
+ *  the pages a lookup touches are read. Trees never change, so the records of a tree
+ *  stay valid whatever HEAD is now; a lookup in a tree that is not in the snapshot
+ *  is simply a miss.
+ */
+class MetaCache
+{
+public:
+    struct Entry
+    {
+        std::string name;
+        git_oid id;
+        git_filemode_t mode;
+        std::uint64_t size; /// Of blobs only
+    };
+
+    /** An entry of tree `dir`, for `save`
+     */
+    struct Item
+    {
+        git_oid dir;
+        Entry entry;
+    };
+
+private:
+    struct Header
+    {
+        char magic[8];
+        git_oid root;
+        std::uint32_t pad;
+        std::uint64_t count;
+    };
+
+    struct Record
+    {
+        git_oid dir;
+        git_oid id;
+        std::uint32_t mode;
+        std::uint32_t nameLen;
+        std::uint64_t nameOff; /// From the start of the names
+        std::uint64_t size;
+    };
+
+    static constexpr const char MAGIC[8] = { 'S', 'F', 'S', 'M', 'E', 'T', 'A', '1' };
+
+    void *map = nullptr;
+    std::size_t mapSize = 0;
+    const Header *header = nullptr;
+    const Record *records = nullptr;
+    const char *names = nullptr;
+    std::size_t namesSize = 0;
+
+    /** Records of tree `dir`, as [*out_begin, *out_end)
+     */
+    void range(const git_oid &dir, const Record **out_begin, const Record **out_end) const;
+    /** @return false if the record points out of the file
+     */
+    bool entry(const Record &r, Entry &out) const;
+
+public:
+    /** Map `file`. A missing or malformed file leaves the cache empty
+     */
+    explicit MetaCache(const std::string &file);
+    ~MetaCache();
+
+    MetaCache(const MetaCache &) = delete;
+    MetaCache &operator=(const MetaCache &) = delete;
+
+    bool empty() const { return !header; }
+    /** The root tree the snapshot was taken of. Only valid if not `empty`
+     */
+    const git_oid &root() const { return header->root; }
+
+    /** @return false if tree `dir` is not in the snapshot
+     */
+    bool list(const git_oid &dir, std::vector<Entry> &out) const;
+    /** @return 0 if found, -ENOENT if `dir` is in the snapshot without entry `name`,
+     *          and 1 if `dir` is not in the snapshot
+     */
+    int find(const git_oid &dir, const std::string &name, Entry &out) const;
+
+    /** Write a snapshot of `root` made of `items` to `file`, replacing it atomically
+     *  @return false on failure, leaving the file as it was
+     */
+    static bool save(const std::string &file, const git_oid &root, std::vector<Item> items);
+};
+
+#endif // META_CACHE_H_
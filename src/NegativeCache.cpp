@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <functional>
+#include "utils.h"
+#include "NegativeCache.h"
+
+static std::string key(const git_oid &id)
+{
+    return std::string((const char *)id.id, GIT_OID_RAWSZ);
+}
+
+NegativeCache::Bloom::Bloom(std::size_t names)
+    : bits(std::max<std::size_t>(1, (names * 10 + 63) / 64), 0)
+{}
+
+template <typename F>
+void NegativeCache::Bloom::probe(const std::string &name, F f) const
+{
+    // Double hashing: the i-th probe is h1 + i * h2
+    std::uint64_t h1 = std::hash<std::string>()(name);
+    std::uint64_t h2 = 14695981039346656037ull; // FNV-1a
+    for (unsigned char c : name)
+        h2 = (h2 ^ c) * 1099511628211ull;
+    h2 |= 1;
+    std::uint64_t size = bits.size() * 64;
+    for (int i = 0; i < HASHES; i++)
+        f((h1 + i * h2) % size);
+}
+
+void NegativeCache::Bloom::add(const std::string &name)
+{
+    probe(name, [this] (std::uint64_t bit) { bits[bit / 64] |= 1ull << (bit % 64); });
+}
+
+bool NegativeCache::Bloom::mayContain(const std::string &name) const
+{
+    bool all = true;
+    probe(name, [&] (std::uint64_t bit) { all = all && (bits[bit / 64] >> (bit % 64) & 1); });
+    return all;
+}
+
+NegativeCache::NegativeCache(const Git &git, std::size_t capacity)
+    : git(git), capacity(capacity)
+{}
+
+bool NegativeCache::absent(const git_oid &tree, const std::string &name)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    auto iter = summaries.find(key(tree));
+    if (iter == summaries.end())
+        return false;
+    ages.splice(ages.begin(), ages, iter->second.age);
+    return !iter->second.bloom.mayContain(name);
+}
+
+void NegativeCache::miss(const git_oid &tree)
+{
+    if (capacity == 0)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (summaries.count(key(tree)))
+            return;
+    }
+
+    std::vector<std::string> names = git.names(tree);
+    Bloom bloom(names.size());
+    for (const auto &name : names)
+        bloom.add(name);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (summaries.count(key(tree)))
+        return;
+    ages.push_front(key(tree));
+    summaries.insert(std::make_pair(key(tree), Entry{std::move(bloom), ages.begin()}));
+    if (summaries.size() > capacity)
+    {
+        summaries.erase(ages.back());
+        ages.pop_back();
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef NEGATIVE_CACHE_H_
+#define NEGATIVE_CACHE_H_
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include "Git.h"
+
+/** Summaries of the names in a tree, answering lookups of missing names
+ *
+ *  A summary is a Bloom filter of the entry names of a tree, built when a name is
+ *  first missed in that tree. Trees never change, so a summary never goes stale; the
+ *  cache keeps those of the `capacity` trees most recently missed in.
+ */
+class NegativeCache
+{
+private:
+    struct Bloom
+    {
+        std::vector<std::uint64_t> bits;
+
+        explicit Bloom(std::size_t names);
+        void add(const std::string &name);
+        bool mayContain(const std::string &name) const;
+
+    private:
+        static constexpr int HASHES = 7; /// About 1% false positives at 10 bits per name
+        template <typename F> void probe(const std::string &name, F f) const;
+    };
+
+    struct Entry
+    {
+        Bloom bloom;
+        std::list<std::string>::iterator age;
+    };
+
+    const Git &git;
+    std::size_t capacity;
+    std::unordered_map<std::string, Entry> summaries; /// Keyed by raw tree oid
+    std::list<std::string> ages; /// Most recently used first
+    std::mutex lock;
+
+public:
+    NegativeCache(const Git &git, std::size_t capacity);
+
+    /** @return true if entry `name` is certainly not in `tree`
+     */
+    bool absent(const git_oid &tree, const std::string &name);
+
+    /** Record a miss in `tree`, summarizing it if it is not yet
+     */
+    void miss(const git_oid &tree);
+};
+
+#endif // NEGATIVE_CACHE_H_
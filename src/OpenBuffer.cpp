@@ -0,0 +1,138 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "IoRing.h"
+#include "OpenBuffer.h"
+
+OpenBuffer::Config OpenBuffer::config;
+std::atomic<std::size_t> OpenBuffer::memBytes(0);
+
+/** Create an anonymous file in the scratch directory
+ *  @return -1 on failure
+ */
+static int scratchFile(const std::string &dir)
+{
+    std::string name = dir + "/sfstemp.XXXXXX";
+    std::vector<char> tmp(name.begin(), name.end());
+    tmp.push_back('\0');
+    int fd = mkostemp(tmp.data(), O_CLOEXEC);
+    if (fd < 0)
+    {
+        perror("mkostemp");
+        return -1;
+    }
+    unlink(tmp.data()); // Nothing is left behind if we crash
+    return fd;
+}
+
+OpenBuffer::OpenBuffer(std::size_t sizeHint)
+{
+    if (sizeHint <= config.maxMemory)
+    {
+        _fd = memfd_create("sfs", MFD_CLOEXEC);
+        if (_fd >= 0)
+        {
+            memory = true;
+            return;
+        }
+        perror("memfd_create");
+    }
+    _fd = scratchFile(config.scratchDir);
+}
+
+OpenBuffer::~OpenBuffer()
+{
+    if (_fd >= 0)
+    {
+        LOG << "close " << _fd << std::endl;
+        close(_fd);
+    }
+    memBytes -= memSize;
+}
+
+void OpenBuffer::configure(const Config &config)
+{
+    OpenBuffer::config = config;
+}
+
+bool OpenBuffer::charge(std::size_t size)
+{
+    std::size_t cur = memBytes.load();
+    do
+    {
+        if (cur + size > config.budget)
+            return false;
+    } while (!memBytes.compare_exchange_weak(cur, cur + size));
+    return true;
+}
+
+bool OpenBuffer::spill()
+{
+    int fd = scratchFile(config.scratchDir);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    ssize_t copied = fstat(_fd, &st) < 0 ? -errno : IoRing::copy(_fd, fd, st.st_size);
+    if (copied < 0 || dup2(fd, _fd) < 0) // Atomically replaces the file readers see
+    {
+        LOG << "spill: " << strerror(copied < 0 ? -copied : errno) << std::endl;
+        close(fd);
+        return false;
+    }
+    close(fd);
+    LOG << "spilled " << copied << " bytes" << std::endl;
+    memory = false;
+    memBytes -= memSize;
+    memSize = 0;
+    return true;
+}
+
+bool OpenBuffer::grow(std::size_t size)
+{
+    if (!memory || size <= memSize)
+        return true;
+    if (size > config.maxMemory || !charge(size - memSize))
+        return spill();
+    memSize = size;
+    return true;
+}
+
+ssize_t OpenBuffer::read(void *buf, std::size_t size, off_t offset) const
+{
+    ssize_t ret = pread(_fd, buf, size, offset);
+    return ret < 0 ? -errno : ret;
+}
+
+ssize_t OpenBuffer::write(const void *buf, std::size_t size, off_t offset)
+{
+    return write(size, offset, [&] () { return IoRing::write(_fd, buf, size, offset); });
+}
+
+ssize_t OpenBuffer::write(std::size_t size, off_t offset, const std::function<ssize_t ()> &copy)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!grow(offset + size))
+        return -ENOSPC;
+    return copy();
+}
+
+int OpenBuffer::truncate(off_t size)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (!grow(size))
+        return -ENOSPC;
+    if (ftruncate(_fd, size) < 0)
+        return -errno;
+    if (memory && (std::size_t)size < memSize)
+    {
+        memBytes -= memSize - size;
+        memSize = size;
+    }
+    return 0;
+}
@@ -0,0 +1,67 @@
+#ifndef OPEN_BUFFER_H_
+#define OPEN_BUFFER_H_
+
+#include <mutex>
+#include <atomic>
+#include <string>
+#include <functional>
+#include <sys/types.h>
+
+/** Contents of an open file
+ *
+ *  Small files live in anonymous memory (memfd). A buffer spills to an unlinked file
+ *  in `scratchDir` once it grows past `maxMemory`, or once all in-memory buffers
+ *  together would exceed `budget`. Spilling swaps the file under the same descriptor,
+ *  so `fd()` stays valid for lock-free readers.
+ */
+class OpenBuffer
+{
+public:
+    struct Config
+    {
+        std::size_t maxMemory = 1 << 20; /// Spill a single buffer beyond this size
+        std::size_t budget = 256 << 20; /// Total size of all in-memory buffers
+        std::string scratchDir = "."; /// Where spilled buffers go, preferably a tmpfs
+    };
+
+private:
+    int _fd = -1;
+    bool memory = false;
+    std::size_t memSize = 0; /// Bytes charged against the budget
+    std::mutex lock; /// Serializes growth and spilling
+
+    static Config config;
+    static std::atomic<std::size_t> memBytes;
+
+    bool charge(std::size_t size);
+    bool spill();
+    bool grow(std::size_t size);
+
+public:
+    /** @param sizeHint Expected size, buffers known to be large go to disk directly
+     */
+    explicit OpenBuffer(std::size_t sizeHint = 0);
+    ~OpenBuffer();
+
+    OpenBuffer(const OpenBuffer &) = delete;
+    OpenBuffer &operator=(const OpenBuffer &) = delete;
+
+    static void configure(const Config &config);
+
+    /** @return -1 if neither memory nor scratch space was available
+     */
+    int fd() const { return _fd; }
+    bool inMemory() const { return memory; }
+
+    /** Same as pread(2) and pwrite(2), except returning -errno on failure
+     */
+    ssize_t read(void *buf, std::size_t size, off_t offset) const;
+    ssize_t write(const void *buf, std::size_t size, off_t offset);
+    /** Like `write`, except that `copy` puts the bytes into `fd()` itself, e.g. by
+     *  splicing them from a pipe
+     */
+    ssize_t write(std::size_t size, off_t offset, const std::function<ssize_t ()> &copy);
+    int truncate(off_t size);
+};
+
+#endif // OPEN_BUFFER_H_
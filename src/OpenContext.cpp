@@ -1,65 +1,133 @@
 #include <cstdio>
-#include <cassert>
-#include <algorithm>
-#include <unistd.h>
+#include <cstring>
+#include <git2.h>
 #include "Git.h"
 #include "utils.h"
 #include "OpenContext.h"
 
-std::unordered_map<std::string, std::vector<OpenContext *> > OpenContext::openContexts;
-std::mutex OpenContext::openContextsLock;
+OpenContext::Shard OpenContext::shards[OpenContext::SHARDS];
+OpenContext::Config OpenContext::config;
 
-OpenContext::OpenContext(const std::string &path, const std::string &tmpfile)
-    : path(path), tmpfile(tmpfile)
+OpenContext::OpenContext(const std::string &path, std::size_t sizeHint)
+    : path(path), buffer(sizeHint)
+{}
+
+OpenContext::~OpenContext()
 {
-    emplaceMap();
+    endStream();
 }
 
-OpenContext::~OpenContext()
+void OpenContext::configure(const Config &config)
 {
-    removeMap();
-    if (fd >= 0)
-    {
-        LOG << "close " << fd << std::endl;
-        close(fd);
-    }
-    if (tmpfile != "")
+    OpenContext::config = config;
+}
+
+OpenContext::Shard &OpenContext::shard(const std::string &path)
+{
+    return shards[std::hash<std::string>()(path) % SHARDS];
+}
+
+void OpenContext::settle(Shard &s, std::unique_lock<std::mutex> &guard, const std::string &path)
+{
+    s.changed.wait(guard, [&] ()
     {
-        LOG << "unlink " << tmpfile.c_str() << std::endl;
-        unlink(tmpfile.c_str());
-    }
+        auto iter = s.contexts.find(path);
+        return iter == s.contexts.end() || iter->second;
+    });
 }
 
-void OpenContext::emplaceMap()
+OpenContext *OpenContext::acquire(const std::string &path, const std::function<OpenContext *()> &make)
 {
-    openContextsLock.lock();
-    openContexts[path].push_back(this);
-    openContextsLock.unlock();
+    Shard &s = shard(path);
+    {
+        std::unique_lock<std::mutex> guard(s.lock);
+        while (true)
+        {
+            auto iter = s.contexts.find(path);
+            if (iter == s.contexts.end())
+                break;
+            OpenContext *ctx = iter->second;
+            if (ctx && !ctx->releasing)
+            {
+                ctx->refs++;
+                LOG << "shared context of " << path.c_str() << std::endl;
+                return ctx;
+            }
+            s.changed.wait(guard); // Until it is loaded, or its commit is published
+        }
+        s.contexts[path] = nullptr;
+    }
+
+    OpenContext *ctx = nullptr;
+    try
+    {
+        ctx = make();
+    }
+    catch (...)
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        s.contexts.erase(path);
+        s.changed.notify_all();
+        throw;
+    }
+    std::lock_guard<std::mutex> guard(s.lock);
+    s.contexts[path] = ctx; // Still ours, as renames and unlinks wait for loads
+    s.changed.notify_all();
+    return ctx;
 }
 
-void OpenContext::removeMap()
+void OpenContext::release(OpenContext *ctx, Git &git, const char *msg)
 {
-    openContextsLock.lock();
-    auto &v = openContexts[path];
-    auto iter = std::find(v.begin(), v.end(), this);
-    assert(iter != v.end());
-    v.erase(iter);
-    if (v.empty())
     {
-        openContexts.erase(path);
+        Shard &s = shard(ctx->path);
+        std::lock_guard<std::mutex> guard(s.lock);
+        if (--ctx->refs > 0)
+            return;
+        ctx->releasing = true;
+    }
+    // Opens of the same path wait until the commit is published, or they would load
+    // the old blob and overwrite this commit with theirs
+    auto finish = [ctx] ()
+    {
+        Shard &s = shard(ctx->path); // Not renamed meanwhile, renames hold `git.rwlock`
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto iter = s.contexts.find(ctx->path);
+        if (iter != s.contexts.end() && iter->second == ctx)
+            s.contexts.erase(iter);
+        s.changed.notify_all();
+    };
+    try
+    {
+        ctx->commit(git, msg);
+    }
+    catch (...)
+    {
+        finish();
+        delete ctx;
+        throw;
     }
-    openContextsLock.unlock();
+    finish();
+    delete ctx;
 }
 
 void OpenContext::commit(Git &git, const char *msg)
 {
     if (dirty)
     {
-        if (path != "")
+        if (stream && streamed == declared && path != "")
+        {
+            LOG << "streamed " << streamed << " bytes" << std::endl;
+            git_odb_stream *s = stream;
+            stream = nullptr;
+            git.commitStream(s, path, msg, executable);
+        }
+        else if (path != "")
         {
-            git.commit(tmpfile, path, msg, executable);
+            endStream(); // A partial stream cannot be committed
+            git.commitFd(buffer.fd(), path, msg, executable);
         }
         dirty = false;
+        pending = false;
     }
     else
     {
@@ -69,39 +137,150 @@ void OpenContext::commit(Git &git, const char *msg)
 
 void OpenContext::truncate(std::size_t len)
 {
-    if (ftruncate(fd, len) < 0)
+    endStream();
+    fresh = false;
+    int err = buffer.truncate(len);
+    if (err < 0)
     {
-        perror("ftruncate");
+        LOG << "truncate: " << strerror(-err) << std::endl;
     }
     // dirty = true; // TODO ?
 }
 
+bool OpenContext::declare(Git &git, std::size_t size)
+{
+    if (!fresh || size < config.streamMin)
+        return false;
+    fresh = false;
+    if (!(stream = git.openBlob(size)))
+        return false;
+    int err = buffer.truncate(size); // Sparse, so reads past the written bytes see zeros
+    if (err < 0)
+    {
+        LOG << "declare: " << strerror(-err) << std::endl;
+        endStream();
+        return false;
+    }
+    declared = size;
+    streamed = 0;
+    dirty = true;
+    return true;
+}
+
+ssize_t OpenContext::write(const void *buf, std::size_t size, off_t offset)
+{
+    fresh = false;
+    ssize_t ret = buffer.write(buf, size, offset);
+    if (ret <= 0 || !stream)
+        return ret;
+    if ((std::size_t)offset != streamed || streamed + ret > declared)
+    {
+        LOG << "stream of " << path.c_str() << " ended by write at " << offset << std::endl;
+        endStream();
+    }
+    else if (git_odb_stream_write(stream, (const char *)buf, ret) < 0)
+    {
+        const git_error *e = giterr_last();
+        LOG << "stream: " << (e ? e->message : "write failed") << std::endl;
+        giterr_clear();
+        endStream();
+    }
+    else
+    {
+        streamed += ret;
+    }
+    return ret;
+}
+
+void OpenContext::endStream()
+{
+    if (stream)
+    {
+        git_odb_stream_free(stream);
+        stream = nullptr;
+    }
+}
+
 void OpenContext::chmod(bool executable)
 {
     this->executable = executable;
     // dirty = true; // TODO ?
 }
 
-void OpenContext::rename(const std::string &newname)
+void OpenContext::rename(const std::string &oldname, const std::string &newname)
 {
-    if (path == newname) return;
+    if (oldname == newname) return;
 
-    removeMap();
-    path = newname;
-    emplaceMap();
-    // dirty = true; // TODO ?
+    Shard &from = shard(oldname), &to = shard(newname);
+    auto loading = [] (Shard &s, const std::string &path)
+    {
+        auto iter = s.contexts.find(path);
+        return iter != s.contexts.end() && !iter->second;
+    };
+    std::unique_lock<std::mutex> first, second;
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> guard(from.lock);
+            settle(from, guard, oldname);
+        }
+        {
+            std::unique_lock<std::mutex> guard(to.lock);
+            settle(to, guard, newname);
+        }
+        // Lock in a fixed order, as another rename may go the other way
+        first = std::unique_lock<std::mutex>(&from < &to ? from.lock : to.lock);
+        if (&from != &to)
+            second = std::unique_lock<std::mutex>(&from < &to ? to.lock : from.lock);
+        if (!loading(from, oldname) && !loading(to, newname))
+            break;
+        if (second.owns_lock())
+            second.unlock();
+        first.unlock(); // Opened again meanwhile
+    }
+
+    auto iter = from.contexts.find(oldname);
+    if (iter == from.contexts.end()) return;
+    OpenContext *ctx = iter->second;
+    from.contexts.erase(iter);
+
+    auto old = to.contexts.find(newname);
+    if (old != to.contexts.end())
+    {
+        old->second->path = ""; // Never committed again
+        to.contexts.erase(old);
+    }
+    ctx->path = newname;
+    to.contexts[newname] = ctx;
 }
 
-void OpenContext::for_each(const std::string &path, const std::function<void (OpenContext *)> &f)
+void OpenContext::detach(const std::string &path)
 {
-    auto iter = openContexts.find(path);
-    if (iter != openContexts.end())
-        for (OpenContext *ctx : iter->second)
-            f(ctx);
+    Shard &s = shard(path);
+    std::unique_lock<std::mutex> guard(s.lock);
+    settle(s, guard, path);
+    auto iter = s.contexts.find(path);
+    if (iter == s.contexts.end()) return;
+    iter->second->path = "";
+    s.contexts.erase(iter);
 }
 
-const std::unordered_map<std::string, std::vector<OpenContext *> > &OpenContext::contexts()
+void OpenContext::for_each(const std::string &path, const std::function<void (OpenContext *)> &f)
 {
-    return openContexts;
+    Shard &s = shard(path);
+    std::lock_guard<std::mutex> guard(s.lock);
+    auto iter = s.contexts.find(path);
+    if (iter != s.contexts.end() && iter->second && !iter->second->releasing)
+        f(iter->second);
 }
 
+void OpenContext::for_each(const std::function<void (OpenContext *)> &f)
+{
+    for (Shard &s : shards)
+    {
+        std::lock_guard<std::mutex> guard(s.lock);
+        for (auto &p : s.contexts)
+            if (p.second && !p.second->releasing)
+                f(p.second);
+    }
+}
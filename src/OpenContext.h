@@ -2,44 +2,124 @@
 #define OPEN_CONTEXT_H_
 
 #include <mutex>
-#include <vector>
 #include <string>
+#include <condition_variable>
 #include <functional>
 #include <unordered_map>
+#include "OpenBuffer.h"
 
 class Git;
+struct git_odb_stream;
 
+/** State of an open file, shared by all of its handles
+ *
+ *  A file is loaded once when first opened and committed once when its last handle
+ *  is released. Contexts are kept in a table sharded by path, so opening and closing
+ *  different files do not contend.
+ *
+ *  A new file whose size is declared up front, by truncating it before writing, is
+ *  also streamed into the object database while it is written from offset 0 on. Its
+ *  commit then needs no further pass over the data. Any other write ends the stream,
+ *  and the file is committed from the buffer as usual.
+ */
 class OpenContext
 {
+public:
+    struct Config
+    {
+        std::size_t streamMin = 1 << 20; /// Smaller files are not worth streaming
+    };
+
 private:
     std::string path;
-    std::string tmpfile;
+    int refs = 1;
+    bool releasing = false; /// Being committed by its last release, still in the table
+
+    git_odb_stream *stream = nullptr;
+    std::size_t declared = 0; /// Size of the blob in `stream`
+    std::size_t streamed = 0; /// Bytes written to `stream` so far
+
+    static Config config;
+
+    static constexpr int SHARDS = 64;
 
-    static std::unordered_map<std::string, std::vector<OpenContext *> > openContexts;
+    struct Shard
+    {
+        std::mutex lock;
+        std::unordered_map<std::string, OpenContext *> contexts; /// nullptr while loading
+        std::condition_variable changed; /// A context finished loading or releasing
+    };
+
+    static Shard shards[SHARDS];
+
+    static Shard &shard(const std::string &path);
+    /** Wait with `s` locked until `path` is not being loaded
+     */
+    static void settle(Shard &s, std::unique_lock<std::mutex> &guard, const std::string &path);
 
 public:
-    int fd = -1;
+    OpenBuffer buffer;
     bool dirty = false;
     bool executable = false;
     bool commit_on_next_write = false;
-    static std::mutex openContextsLock;
-
-    explicit OpenContext(const std::string &path, const std::string &tmpfile);
+    bool fresh = false; /// Created empty and not written since, see `declare`
+    bool pending = false; /// Created, and not committed yet
 
+    explicit OpenContext(const std::string &path, std::size_t sizeHint = 0);
     ~OpenContext();
 
+    OpenContext(const OpenContext &) = delete;
+    OpenContext &operator=(const OpenContext &) = delete;
+
+    static void configure(const Config &config);
+
+    const std::string &filePath() const { return path; }
+
     void commit(Git &git, const char *msg);
     void truncate(std::size_t len);
     void chmod(bool executable);
-    void rename(const std::string &newname);
 
-    static void for_each(const std::string &path, const std::function<void (OpenContext *)> &f);
-    static const std::unordered_map<std::string, std::vector<OpenContext *> > &contexts();
+    /** Truncate a fresh file to `size`, and stream it into the object database
+     *  Call with `git.rwlock` held.
+     *  @return false if it does not stream, in which case nothing is done
+     */
+    bool declare(Git &git, std::size_t size);
+    /** Write to the buffer, and to the stream if this continues it. Same as
+     *  `OpenBuffer::write` otherwise
+     */
+    ssize_t write(const void *buf, std::size_t size, off_t offset);
+    bool streaming() const { return stream != nullptr; }
+    /** Give up streaming. The buffer has all the data already
+     */
+    void endStream();
 
-private:
-    void emplaceMap();
-    void removeMap();
+    /** Take a reference to the context of `path`, calling `make` if it is not open yet
+     *  `make` runs without the shard locked, while other opens of `path` wait for it; an
+     *  exception from it leaves the table as is. An open of a context being released
+     *  waits until its commit is published, and then loads the file afresh.
+     */
+    static OpenContext *acquire(const std::string &path, const std::function<OpenContext *()> &make);
+
+    /** Drop a reference. The last one commits with `msg` and deletes the context, which
+     *  stays in the table until the commit is published.
+     *  Call with `git.rwlock` held.
+     */
+    static void release(OpenContext *ctx, Git &git, const char *msg);
+
+    /** Move the context of `oldname` to `newname`
+     *  A context already at `newname` belongs to a replaced file and is detached.
+     *  Call with `git.rwlock` held, so that no context is being released.
+     */
+    static void rename(const std::string &oldname, const std::string &newname);
+    /** Remove the context of `path` from the table, so that it is never committed
+     *  Call with `git.rwlock` held.
+     */
+    static void detach(const std::string &path);
+
+    /** Call `f` on the open contexts, skipping those being loaded or released
+     */
+    static void for_each(const std::string &path, const std::function<void (OpenContext *)> &f);
+    static void for_each(const std::function<void (OpenContext *)> &f);
 };
 
 #endif // OPEN_CONTEXT_H_
-
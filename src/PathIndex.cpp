@@ -0,0 +1,217 @@
+#include <ctime>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include "utils.h"
+#include "PathIndex.h"
+
+// Record format: "<commit id> <time> <+|-> <path>\0"
+// or, for a time set explicitly: "T <mtime> <time set> <last commit id> <path>\0"
+// Records "t <mtime> <time set> <path>\0" of older versions hold since the commit
+// recorded before them
+
+PathIndex::PathIndex(const std::string &file)
+    : file(file)
+{
+    std::ifstream fin(file.c_str(), std::ios::binary);
+    std::string record;
+    while (std::getline(fin, record, '\0'))
+    {
+        std::istringstream is(record);
+        std::string idstr, op, path;
+        long long time;
+        git_oid id;
+        if (record.compare(0, 2, "t ") == 0 || record.compare(0, 2, "T ") == 0)
+        {
+            bool based = record[0] == 'T';
+            long long mtime, when;
+            is.ignore(2);
+            if (!(is >> mtime >> when) || (based && !(is >> idstr)) || is.get() != ' ' ||
+                !std::getline(is, path) || (based && git_oid_fromstr(&id, idstr.c_str()) < 0))
+            {
+                LOG << "path index: ignoring malformed record" << std::endl;
+                continue;
+            }
+            touches[path] = { (time_t)mtime, (time_t)when, based ? id : lastLocked(path) };
+            continue;
+        }
+        if (!(is >> idstr >> time >> op) || is.get() != ' ' || !std::getline(is, path) ||
+            (op != "+" && op != "-") || git_oid_fromstr(&id, idstr.c_str()) < 0)
+        {
+            LOG << "path index: ignoring malformed record" << std::endl;
+            continue;
+        }
+        Git::Change change = { path, op == "-" };
+        insert(id, time, change);
+    }
+    out = fopen(file.c_str(), "ab");
+    if (!out)
+        perror("fopen");
+}
+
+PathIndex::~PathIndex()
+{
+    if (out)
+        fclose(out);
+}
+
+void PathIndex::insert(const git_oid &id, time_t time, const Git::Change &change)
+{
+    Entry e;
+    e.id = id;
+    e.time = time;
+    e.removed = change.removed;
+    entries[change.path].push_back(e);
+    lastId = id;
+    empty = false;
+
+    // Every directory up to the root has changed below
+    std::string dir = change.path;
+    do
+    {
+        dir = dir.substr(0, dir.rfind('/'));
+        time_t &last = dirTimes[dir.empty() ? "/" : dir];
+        last = std::max(last, time);
+        dirLast[dir.empty() ? "/" : dir] = id;
+    } while (!dir.empty());
+}
+
+void PathIndex::writeTouch(const std::string &path, const Touch &touch)
+{
+    if (out)
+    {
+        char idstr[GIT_OID_HEXSZ + 1];
+        git_oid_tostr(idstr, sizeof idstr, &touch.base);
+        fprintf(out, "T %lld %lld %s ", (long long)touch.mtime, (long long)touch.when, idstr);
+        fwrite(path.c_str(), 1, path.length() + 1, out);
+    }
+}
+
+git_oid PathIndex::lastLocked(const std::string &path) const
+{
+    auto iter = entries.find(path);
+    if (iter != entries.end())
+        return iter->second.back().id;
+    auto dir = dirLast.find(path);
+    if (dir != dirLast.end())
+        return dir->second;
+    git_oid none;
+    memset(&none, 0, sizeof none);
+    return none;
+}
+
+bool PathIndex::validLocked(const Touch &touch, const std::string &path) const
+{
+    git_oid last = lastLocked(path);
+    return git_oid_equal(&touch.base, &last); // Not committed since
+}
+
+const git_oid *PathIndex::last() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return empty ? nullptr : &lastId;
+}
+
+void PathIndex::clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    entries.clear();
+    dirTimes.clear();
+    dirLast.clear();
+    empty = true;
+    if (out)
+        fclose(out);
+    out = fopen(file.c_str(), "wb");
+    if (!out)
+        perror("fopen");
+    for (const auto &p : touches) // Not derived from the history, so kept
+        writeTouch(p.first, p.second);
+}
+
+void PathIndex::record(const git_oid &id, time_t time, const std::vector<Git::Change> &changes)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    char idstr[GIT_OID_HEXSZ + 1];
+    git_oid_tostr(idstr, sizeof idstr, &id);
+    for (const auto &change : changes)
+    {
+        insert(id, time, change);
+        if (out)
+        {
+            fprintf(out, "%s %lld %c ", idstr, (long long)time, change.removed ? '-' : '+');
+            fwrite(change.path.c_str(), 1, change.path.length() + 1, out);
+        }
+    }
+    if (out)
+        fflush(out);
+}
+
+std::vector<Git::Version> PathIndex::versions(const std::string &path) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<Git::Version> list;
+    auto iter = entries.find(path);
+    if (iter == entries.end())
+        return list;
+    for (auto e = iter->second.rbegin(); e != iter->second.rend(); ++e)
+        if (!e->removed)
+        {
+            Git::Version v;
+            v.id = e->id;
+            v.time = e->time;
+            list.push_back(v);
+        }
+    return list;
+}
+
+void PathIndex::touch(const std::string &path, time_t mtime)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    Touch &t = touches[path];
+    t.mtime = mtime;
+    t.when = time(nullptr);
+    t.base = lastLocked(path);
+    writeTouch(path, t);
+    if (out)
+        fflush(out);
+}
+
+void PathIndex::times(const std::string &path, time_t *out_mtime, time_t *out_ctime) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    time_t time = 0;
+    auto iter = entries.find(path);
+    if (iter != entries.end())
+        time = iter->second.back().time;
+    else
+    {
+        auto dir = dirTimes.find(path);
+        if (dir != dirTimes.end())
+            time = dir->second;
+    }
+    *out_mtime = *out_ctime = time;
+    auto t = touches.find(path);
+    if (t != touches.end() && validLocked(t->second, path))
+    {
+        *out_mtime = t->second.mtime;
+        *out_ctime = t->second.when;
+    }
+}
+
+std::vector<std::pair<std::string, time_t> > PathIndex::touchesBelow(const std::string &path) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::vector<std::pair<std::string, time_t> > list;
+    for (const auto &p : touches)
+    {
+        const std::string &name = p.first;
+        if (name.compare(0, path.length(), path) != 0 ||
+            (name.length() > path.length() && name[path.length()] != '/'))
+            continue;
+        if (validLocked(p.second, name))
+            list.push_back(std::make_pair(name.substr(path.length()), p.second.mtime));
+    }
+    return list;
+}
@@ -0,0 +1,88 @@
+#ifndef PATH_INDEX_H_
+#define PATH_INDEX_H_
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <unordered_map>
+#include "Git.h"
+
+/** Incremental index from paths to the commits touching them
+ *
+ *  Records are appended to a file inside .git as commits are created, so listing
+ *  the versions of a file costs O(versions of that file) instead of a history walk.
+ *  The file is only a cache: a missing or stale tail is rebuilt from the history.
+ *
+ *  It also gives the times of paths: a file was modified by the last commit touching
+ *  it, a directory by the last one touching anything below it. Times set explicitly
+ *  are appended to the same file together with that last commit, and hold as long
+ *  as it is still the last one.
+ */
+class PathIndex
+{
+private:
+    struct Entry
+    {
+        git_oid id;
+        time_t time;
+        bool removed;
+    };
+
+    /** A time set explicitly, when it was set, and the last commit of the path then
+     */
+    struct Touch
+    {
+        time_t mtime;
+        time_t when;
+        git_oid base; /// Zero if the path had not been committed
+    };
+
+    std::unordered_map<std::string, std::vector<Entry> > entries;
+    std::unordered_map<std::string, time_t> dirTimes; /// Latest change below each directory
+    std::unordered_map<std::string, git_oid> dirLast; /// Commit of that change
+    std::unordered_map<std::string, Touch> touches;
+    git_oid lastId; /// The last commit recorded
+    bool empty = true;
+    std::string file;
+    FILE *out = nullptr;
+    mutable std::mutex lock;
+
+    void insert(const git_oid &id, time_t time, const Git::Change &change);
+    void writeTouch(const std::string &path, const Touch &touch);
+    /** The last commit touching `path` or anything below it, zero if none
+     */
+    git_oid lastLocked(const std::string &path) const;
+    bool validLocked(const Touch &touch, const std::string &path) const;
+
+public:
+    explicit PathIndex(const std::string &file);
+    ~PathIndex();
+
+    /** @return The last commit recorded, or nullptr if nothing is recorded
+     */
+    const git_oid *last() const;
+
+    /** Drop all records, in memory and on disk
+     */
+    void clear();
+
+    void record(const git_oid &id, time_t time, const std::vector<Git::Change> &changes);
+
+    /** Versions where `path` exists, the latest first
+     */
+    std::vector<Git::Version> versions(const std::string &path) const;
+
+    /** Set the modification time of `path` explicitly
+     */
+    void touch(const std::string &path, time_t mtime);
+    /** Times set explicitly at `path` and below that still hold, by the rest of their
+     *  path after `path`. For carrying them over to where `path` is moved or copied
+     */
+    std::vector<std::pair<std::string, time_t> > touchesBelow(const std::string &path) const;
+    /** Modification and change time of `path`, 0 if it has never been committed
+     */
+    void times(const std::string &path, time_t *out_mtime, time_t *out_ctime) const;
+};
+
+#endif // PATH_INDEX_H_
@@ -0,0 +1,174 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "utils.h"
+#include "Repacker.h"
+
+Repacker::Config Repacker::config;
+std::string Repacker::gitPath;
+std::string Repacker::objectsPath;
+std::thread Repacker::repack_thread;
+std::atomic<time_t> Repacker::lastCommit(0);
+
+/** Like git's `gc --auto`, loose objects are counted in one fan-out directory only
+ */
+static constexpr const char *SAMPLE_DIR = "17";
+static constexpr int SAMPLE_FACTOR = 256;
+
+static constexpr std::size_t REMOVE_BATCH = 256;
+
+void Repacker::notifyCommit()
+{
+    lastCommit = time(nullptr);
+}
+
+bool Repacker::idle()
+{
+    return time(nullptr) - lastCommit >= config.idle;
+}
+
+void Repacker::estimate(std::size_t &objects, std::size_t &bytes)
+{
+    objects = bytes = 0;
+    std::string dir = objectsPath + SAMPLE_DIR + "/";
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+    while (struct dirent *ent = readdir(d))
+    {
+        struct stat st;
+        if (strlen(ent->d_name) != GIT_OID_HEXSZ - 2 || stat((dir + ent->d_name).c_str(), &st) < 0)
+            continue;
+        objects += SAMPLE_FACTOR;
+        bytes += st.st_size * SAMPLE_FACTOR;
+    }
+    closedir(d);
+}
+
+std::vector<git_oid> Repacker::looseObjects()
+{
+    std::vector<git_oid> list;
+    for (int i = 0; i < 256; i++)
+    {
+        char fanout[3];
+        snprintf(fanout, sizeof fanout, "%02x", i);
+        DIR *d = opendir((objectsPath + fanout).c_str());
+        if (!d) continue;
+        while (struct dirent *ent = readdir(d))
+        {
+            git_oid id;
+            std::string hex = std::string(fanout) + ent->d_name;
+            if (hex.length() == GIT_OID_HEXSZ && git_oid_fromstr(&id, hex.c_str()) == 0)
+                list.push_back(id);
+        }
+        closedir(d);
+    }
+    return list;
+}
+
+void Repacker::throttle(std::size_t bytes, const timespec &since)
+{
+    if (!config.throttle) return;
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (now.tv_sec - since.tv_sec) + (now.tv_nsec - since.tv_nsec) / 1e9;
+    double expected = (double)bytes / config.throttle;
+    if (expected > elapsed)
+        usleep((useconds_t)((expected - elapsed) * 1e6));
+}
+
+struct PackPayload
+{
+    timespec start;
+};
+
+void Repacker::repack()
+{
+    std::vector<git_oid> objects = looseObjects();
+    if (objects.empty()) return;
+    LOG << "Repacking " << objects.size() << " loose objects..." << std::endl;
+
+    git_repository *repo = nullptr;
+    git_packbuilder *pb = nullptr;
+    bool packed = false;
+    PackPayload payload;
+    clock_gettime(CLOCK_MONOTONIC, &payload.start);
+    if (git_repository_open_bare(&repo, gitPath.c_str()) == 0 &&
+        git_packbuilder_new(&pb, repo) == 0)
+    {
+        git_packbuilder_set_threads(pb, 1);
+        bool ok = true;
+        for (const auto &id : objects)
+            if (git_packbuilder_insert(pb, &id, nullptr) < 0)
+            {
+                ok = false;
+                break;
+            }
+        auto progress = [] (const git_transfer_progress *stats, void *payload) -> int
+        {
+            throttle(stats->received_bytes, ((PackPayload *)payload)->start);
+            return 0;
+        };
+        packed = ok && git_packbuilder_write(pb, (objectsPath + "pack").c_str(), 0, progress, &payload) == 0;
+    }
+    if (!packed)
+    {
+        const git_error *e = giterr_last();
+        LOG << "Repacking failed: " << (e ? e->message : "unknown error") << std::endl;
+    }
+    git_packbuilder_free(pb);
+    git_repository_free(repo);
+    if (!packed) return;
+
+    // Readers that miss a removed loose object refresh the packs and retry,
+    // so the loose copies can go now
+    clock_gettime(CLOCK_MONOTONIC, &payload.start);
+    std::size_t removed = 0, bytes = 0;
+    for (std::size_t i = 0; i < objects.size(); i++)
+    {
+        char hex[GIT_OID_HEXSZ + 1];
+        git_oid_tostr(hex, sizeof hex, &objects[i]);
+        std::string file = objectsPath + std::string(hex, 2) + "/" + (hex + 2);
+        struct stat st;
+        if (stat(file.c_str(), &st) == 0 && unlink(file.c_str()) == 0)
+        {
+            bytes += st.st_size;
+            removed++;
+        }
+        if ((i + 1) % REMOVE_BATCH == 0)
+        {
+            throttle(bytes, payload.start);
+            while (!idle())
+                sleep(1);
+        }
+    }
+    LOG << "Repacked, " << removed << " loose objects removed" << std::endl;
+}
+
+void Repacker::repack_loop()
+{
+    if (!config.looseObjects && !config.looseBytes) return;
+
+    while (true)
+    {
+        sleep(std::max(config.idle, 1));
+        if (!idle()) continue;
+        std::size_t objects, bytes;
+        estimate(objects, bytes);
+        if ((config.looseObjects && objects >= config.looseObjects) ||
+            (config.looseBytes && bytes >= config.looseBytes))
+            repack();
+    }
+}
+
+void Repacker::start(const std::string &gitPath, const Config &config)
+{
+    Repacker::config = config;
+    Repacker::gitPath = gitPath;
+    objectsPath = gitPath + "/objects/";
+    notifyCommit();
+    repack_thread = std::thread(repack_loop);
+    repack_thread.detach();
+}
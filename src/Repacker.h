@@ -0,0 +1,50 @@
+#ifndef REPACKER_H_
+#define REPACKER_H_
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include <ctime>
+#include <git2.h>
+
+/** Background thread packing loose objects into packfiles
+ *
+ *  It works on its own repository handle and never takes `Git::rwlock`. Instead it
+ *  only runs when no commit has been made for a while, and backs off as soon as
+ *  commits resume.
+ */
+class Repacker
+{
+public:
+    struct Config
+    {
+        std::size_t looseObjects = 6700; /// Repack when this many loose objects are estimated, 0 to disable
+        std::size_t looseBytes = 0; /// Repack when the loose objects take this many bytes, 0 to ignore
+        int idle = 30; /// Seconds without commits before repacking
+        std::size_t throttle = 16 << 20; /// Bytes per second written or removed, 0 for unlimited
+    };
+
+private:
+    static Config config;
+    static std::string gitPath;
+    static std::string objectsPath;
+    static std::thread repack_thread;
+    static std::atomic<time_t> lastCommit;
+
+    static void repack_loop();
+    static bool idle();
+    static void estimate(std::size_t &objects, std::size_t &bytes);
+    static std::vector<git_oid> looseObjects();
+    static void repack();
+    static void throttle(std::size_t bytes, const timespec &since);
+
+public:
+    static void start(const std::string &gitPath, const Config &config);
+
+    /** Called on every commit, so that repacking gets out of the way
+     */
+    static void notifyCommit();
+};
+
+#endif // REPACKER_H_
@@ -0,0 +1,94 @@
+#include <atomic>
+#include <unordered_map>
+#include <git2/sys/repository.h>
+#include "Git.h"
+#include "RepoPool.h"
+
+/** Handle owned by the current thread, returned to its pool at thread exit
+ */
+struct ThreadHandle
+{
+    std::uint64_t generation = 0; /// Of its pool, 0 for none
+    git_repository *repo = nullptr;
+
+    ~ThreadHandle()
+    {
+        if (generation)
+            RepoPool::giveBack(generation, repo);
+    }
+};
+
+static thread_local ThreadHandle threadHandle;
+
+static std::atomic<std::uint64_t> nextGeneration(1);
+static std::unordered_map<std::uint64_t, RepoPool *> livePools;
+static std::mutex livePoolsLock; /// Held while a handle goes back, so its pool stays alive
+
+RepoPool::RepoPool(const std::string &path, git_repository *repo)
+    : path(path), generation(nextGeneration++)
+{
+    if (git_repository_odb(&odb, repo) < 0)
+        throw Git::Error(GIT_ERROR, "RepoPool: cannot get the object database");
+    std::lock_guard<std::mutex> guard(livePoolsLock);
+    livePools[generation] = this;
+}
+
+RepoPool::~RepoPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(livePoolsLock);
+        livePools.erase(generation);
+    }
+    for (git_repository *repo : all)
+        git_repository_free(repo);
+    git_odb_free(odb);
+}
+
+git_repository *RepoPool::acquire()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!idle.empty())
+        {
+            git_repository *repo = idle.back();
+            idle.pop_back();
+            return repo;
+        }
+    }
+    git_repository *repo = nullptr;
+    if (git_repository_open_bare(&repo, path.c_str()) < 0 || git_repository_set_odb(repo, odb) < 0)
+    {
+        git_repository_free(repo);
+        throw Git::Error(GIT_ERROR, "RepoPool: cannot open " + path);
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    all.push_back(repo);
+    return repo;
+}
+
+void RepoPool::release(git_repository *repo)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    idle.push_back(repo);
+}
+
+void RepoPool::giveBack(std::uint64_t generation, git_repository *repo)
+{
+    std::lock_guard<std::mutex> guard(livePoolsLock);
+    auto iter = livePools.find(generation);
+    if (iter != livePools.end())
+        iter->second->release(repo);
+}
+
+git_repository *RepoPool::get()
+{
+    if (threadHandle.generation != generation)
+    {
+        if (threadHandle.generation)
+            giveBack(threadHandle.generation, threadHandle.repo);
+        threadHandle.generation = 0;
+        threadHandle.repo = acquire();
+        threadHandle.generation = generation;
+    }
+    return threadHandle.repo;
+}
@@ -0,0 +1,48 @@
+#ifndef REPO_POOL_H_
+#define REPO_POOL_H_
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <git2.h>
+
+/** Pool of repository handles, one per thread, sharing the object database
+ *
+ *  libgit2 objects of one repository must not be used by several threads at a
+ *  time. Every reading thread therefore gets a handle of its own. The handles share
+ *  the odb of the main handle, so pack indexes, mapped pack windows and staged
+ *  objects are shared, while each handle keeps its own object cache. A handle goes
+ *  back to the pool when its thread exits and is reused by later threads.
+ *
+ *  Threads know their pool by a generation number, never by address, and return
+ *  handles through a registry of the live pools. A handle outliving its pool is
+ *  dropped without being touched, as the pool has freed it.
+ */
+class RepoPool
+{
+private:
+    std::string path;
+    git_odb *odb = nullptr;
+    std::vector<git_repository *> idle;
+    std::vector<git_repository *> all;
+    std::mutex lock;
+    std::uint64_t generation;
+
+    git_repository *acquire();
+    void release(git_repository *repo);
+
+public:
+    RepoPool(const std::string &path, git_repository *repo);
+    ~RepoPool();
+
+    /** The handle of the calling thread
+     */
+    git_repository *get();
+
+    /** Return `repo` to the pool of `generation`, if it is still alive
+     */
+    static void giveBack(std::uint64_t generation, git_repository *repo);
+};
+
+#endif // REPO_POOL_H_
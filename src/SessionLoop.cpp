@@ -0,0 +1,137 @@
+#define FUSE_USE_VERSION 26
+#define _FILE_OFFSET_BITS 64
+
+#include <cerrno>
+#include <algorithm>
+#include <pthread.h>
+#include <fuse_lowlevel.h>
+#include "utils.h"
+#include "SessionLoop.h"
+
+SessionLoop::SessionLoop(struct fuse_session *se, struct fuse_chan *ch, const Config &config)
+    : se(se), ch(ch), config(config)
+{
+    if (this->config.workers == 0)
+        this->config.workers = 1;
+    unsigned count = config.perCore ? this->config.workers : 1;
+    for (unsigned i = 0; i < count; i++)
+        queues.emplace_back(new Queue);
+}
+
+std::vector<char> SessionLoop::buffer()
+{
+    std::lock_guard<std::mutex> guard(poolLock);
+    if (pool.empty())
+        return std::vector<char>(fuse_chan_bufsize(ch));
+    std::vector<char> mem = std::move(pool.back());
+    pool.pop_back();
+    return mem;
+}
+
+void SessionLoop::push(Queue &queue, Request &&request)
+{
+    std::unique_lock<std::mutex> guard(queue.lock);
+    queue.notFull.wait(guard, [&] () { return queue.requests.size() < config.queue; });
+    queue.requests.push_back(std::move(request));
+    queue.notEmpty.notify_one();
+}
+
+void SessionLoop::work(unsigned id)
+{
+    Queue &queue = *queues[id % queues.size()];
+    if (config.perCore)
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(id % std::max(1u, std::thread::hardware_concurrency()), &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus);
+    }
+
+    while (true)
+    {
+        std::vector<Request> batch;
+        {
+            std::unique_lock<std::mutex> guard(queue.lock);
+            queue.notEmpty.wait(guard, [&] () { return !queue.requests.empty(); });
+            while (!queue.requests.empty() && batch.size() < config.batch)
+            {
+                batch.push_back(std::move(queue.requests.front()));
+                queue.requests.pop_front();
+                if (!batch.back().ch)
+                    break; // Leave other stop requests to other workers
+            }
+            queue.notFull.notify_all();
+        }
+
+        if (beforeBatch) beforeBatch();
+        bool stop = false;
+        for (Request &request : batch)
+        {
+            if (!request.ch)
+            {
+                stop = true;
+                continue;
+            }
+            struct fuse_buf buf;
+            buf.size = request.size;
+            buf.flags = (enum fuse_buf_flags)0;
+            buf.mem = request.mem.data();
+            buf.fd = -1;
+            buf.pos = 0;
+            fuse_session_process_buf(se, &buf, request.ch);
+        }
+        if (afterBatch) afterBatch();
+
+        {
+            std::lock_guard<std::mutex> guard(poolLock);
+            for (Request &request : batch)
+                if (request.ch)
+                    pool.push_back(std::move(request.mem));
+        }
+        if (stop)
+            return;
+    }
+}
+
+int SessionLoop::run()
+{
+    for (unsigned i = 0; i < config.workers; i++)
+        workers.emplace_back(&SessionLoop::work, this, i);
+    LOG << "session loop: " << config.workers << " workers, " << queues.size() << " queues" << std::endl;
+
+    int res = 0;
+    std::size_t next = 0;
+    while (!fuse_session_exited(se))
+    {
+        Request request;
+        request.mem = buffer();
+        struct fuse_chan *tmpch = ch;
+        struct fuse_buf buf;
+        buf.size = request.mem.size();
+        buf.flags = (enum fuse_buf_flags)0;
+        buf.mem = request.mem.data();
+        buf.fd = -1;
+        buf.pos = 0;
+        res = fuse_session_receive_buf(se, &buf, &tmpch);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        request.size = buf.size;
+        request.ch = tmpch;
+        push(*queues[next++ % queues.size()], std::move(request));
+    }
+
+    // Every worker takes exactly one stop request
+    for (unsigned i = 0; i < config.workers; i++)
+    {
+        Request stop;
+        stop.size = 0;
+        stop.ch = nullptr;
+        push(*queues[i % queues.size()], std::move(stop));
+    }
+    for (std::thread &worker : workers)
+        worker.join();
+    fuse_session_reset(se);
+    return res < 0 ? -1 : 0;
+}
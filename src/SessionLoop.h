@@ -0,0 +1,74 @@
+#ifndef SESSION_LOOP_H_
+#define SESSION_LOOP_H_
+
+#include <mutex>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+struct fuse_session;
+struct fuse_chan;
+
+/** Request loop of a FUSE session, replacing the one of libfuse
+ *
+ *  The calling thread reads requests from the channel into bounded queues, and a
+ *  fixed pool of workers takes them out in batches. With `perCore`, every worker has
+ *  a queue of its own and is pinned to a CPU. Requests are read into memory, so
+ *  incoming data is never spliced.
+ */
+class SessionLoop
+{
+public:
+    struct Config
+    {
+        unsigned workers = 4;
+        std::size_t queue = 64; /// Requests waiting per queue before reading blocks
+        bool perCore = false;
+        std::size_t batch = 16; /// Requests a worker takes at once
+    };
+
+    /** Called by a worker around each batch, e.g. to let it share one tree
+     */
+    std::function<void ()> beforeBatch, afterBatch;
+
+private:
+    struct Request
+    {
+        std::vector<char> mem;
+        std::size_t size;
+        struct fuse_chan *ch; /// nullptr asks the worker to stop
+    };
+
+    struct Queue
+    {
+        std::mutex lock;
+        std::condition_variable notEmpty, notFull;
+        std::deque<Request> requests;
+    };
+
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    Config config;
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::vector<std::thread> workers;
+
+    std::mutex poolLock;
+    std::vector<std::vector<char> > pool; /// Buffers of finished requests, for reuse
+
+    std::vector<char> buffer();
+    void push(Queue &queue, Request &&request);
+    void work(unsigned id);
+
+public:
+    SessionLoop(struct fuse_session *se, struct fuse_chan *ch, const Config &config);
+
+    /** Serve until the session exits
+     *  @return 0 on a clean exit
+     */
+    int run();
+};
+
+#endif // SESSION_LOOP_H_
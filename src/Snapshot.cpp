@@ -0,0 +1,162 @@
+#include <cctype>
+#include <cstring>
+#include <mutex>
+#include <algorithm>
+#include <unordered_map>
+#include "utils.h"
+#include "mangle.h"
+#include "Snapshot.h"
+
+const std::string Snapshot::DIR = "/.sfs-snapshots";
+
+static constexpr const char *NAME_TIME_FORMAT = "%Y-%m-%dT%H:%M:%S";
+
+/** Commits `@<time>` names resolved to. New commits are stamped with the current
+ *  time, so the answer for a time already past never changes
+ */
+static std::unordered_map<std::string, std::string> resolved;
+static std::mutex resolvedLock;
+static constexpr std::size_t RESOLVED_MAX = 4096;
+
+Snapshot::Snapshot(Git::BlobPtr &&blob)
+    : blob(std::move(blob))
+{}
+
+bool Snapshot::match(const std::string &path)
+{
+    return path.compare(0, DIR.length(), DIR) == 0 &&
+           (path.length() == DIR.length() || path[DIR.length()] == '/');
+}
+
+std::string Snapshot::name(const Git::Version &version)
+{
+    char timestr[64], idstr[GIT_OID_HEXSZ + 1];
+    struct tm tm1;
+    localtime_r(&version.time, &tm1);
+    strftime(timestr, sizeof timestr, NAME_TIME_FORMAT, &tm1);
+    git_oid_tostr(idstr, sizeof idstr, &version.id);
+    return std::string(timestr) + "_" + idstr;
+}
+
+std::string Snapshot::resolve(const Git &git, const std::string &name)
+{
+    if (name.length() > 1 && name[0] == '@')
+    {
+        // The latest version committed no later than the given time
+        {
+            std::lock_guard<std::mutex> guard(resolvedLock);
+            auto iter = resolved.find(name);
+            if (iter != resolved.end() && iter->second.empty())
+                throw Git::Error(GIT_ENOTFOUND, "snapshot: no version before " + name);
+            if (iter != resolved.end())
+                return iter->second;
+        }
+        time_t time = string2time(name.substr(1));
+        if (time == -1)
+            throw Git::Error(GIT_ENOTFOUND, "snapshot: bad time " + name);
+        std::string id; // Empty if there is no such version
+        for (const auto &v : git.listVersions())
+            if (v.time <= time)
+            {
+                char idstr[GIT_OID_HEXSZ + 1];
+                git_oid_tostr(idstr, sizeof idstr, &v.id);
+                id = idstr;
+                break;
+            }
+        if (time < ::time(nullptr))
+        {
+            std::lock_guard<std::mutex> guard(resolvedLock);
+            if (resolved.size() >= RESOLVED_MAX)
+                resolved.clear();
+            resolved[name] = id;
+        }
+        if (id.empty())
+            throw Git::Error(GIT_ENOTFOUND, "snapshot: no version before " + name);
+        return id;
+    }
+    std::size_t pos = name.rfind('_');
+    if (pos != std::string::npos && name.length() - pos - 1 == GIT_OID_HEXSZ &&
+        std::all_of(name.begin() + pos + 1, name.end(), [] (char c) { return isxdigit(c); }))
+        return name.substr(pos + 1);
+    return name;
+}
+
+bool Snapshot::parse(const Git &git, const std::string &path, std::string &rev, std::string &inner)
+{
+    if (path.length() <= DIR.length() + 1)
+        return false;
+    std::size_t begin = DIR.length() + 1;
+    std::size_t end = path.find('/', begin);
+    rev = resolve(git, path.substr(begin, end == std::string::npos ? std::string::npos : end - begin));
+    inner = end == std::string::npos ? "/" : path_mangle(path.substr(end));
+    return true;
+}
+
+struct stat Snapshot::getAttr(const Git &git, const std::string &path)
+{
+    std::string rev, inner;
+    if (!parse(git, path, rev, inner))
+        return git.getAttr("/").stat;
+    struct stat st = git.getAttr(rev, inner).stat;
+    st.st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+    return st;
+}
+
+std::vector<Git::FileAttr> Snapshot::listDir(const Git &git, const std::string &path)
+{
+    std::string rev, inner;
+    if (parse(git, path, rev, inner))
+    {
+        auto list = git.listDir(rev, inner);
+        for (auto &item : list)
+        {
+            item.name = path_demangle(item.name);
+            item.stat.st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
+        }
+        return list;
+    }
+
+    std::vector<Git::FileAttr> list;
+    struct stat st = git.getAttr("/").stat;
+    for (const auto &v : git.listVersions())
+    {
+        Git::FileAttr attr;
+        attr.name = name(v);
+        attr.stat = st;
+        list.push_back(attr);
+    }
+    return list;
+}
+
+Snapshot *Snapshot::open(const Git &git, const std::string &path)
+{
+    std::string rev, inner;
+    if (!parse(git, path, rev, inner))
+        throw Git::Error(GIT_ENOTFOUND, "snapshot: not a file " + path);
+    return open(git.blob(rev, inner));
+}
+
+Snapshot *Snapshot::open(Git::BlobPtr &&blob)
+{
+    return new Snapshot(std::move(blob));
+}
+
+const char *Snapshot::view(size_t &size, off_t offset) const
+{
+    off_t total = git_blob_rawsize(blob.get());
+    if (offset >= total)
+    {
+        size = 0;
+        return nullptr;
+    }
+    size = std::min<off_t>(size, total - offset);
+    return (const char *)git_blob_rawcontent(blob.get()) + offset;
+}
+
+int Snapshot::read(char *buf, size_t size, off_t offset) const
+{
+    const char *data = view(size, offset);
+    if (size)
+        memcpy(buf, data, size);
+    return size;
+}
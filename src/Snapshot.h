@@ -0,0 +1,47 @@
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_
+
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include "Git.h"
+
+/** Read-only view of historical trees under a hidden directory of the mount
+ *
+ *  /.sfs-snapshots/<time>_<commit id>/... serves the tree of that commit.
+ *  Any other revision libgit2 understands (e.g. `HEAD~3`, an abbreviated id) or
+ *  `@<version_time>` may be used as the directory name as well. Nothing is checked
+ *  out: reads come straight from the blobs.
+ */
+class Snapshot
+{
+private:
+    Git::BlobPtr blob;
+
+    explicit Snapshot(Git::BlobPtr &&blob);
+
+    /** Split a snapshot path into a revision and a (mangled) path inside it
+     *  @return false if `path` is the snapshot directory itself
+     */
+    static bool parse(const Git &git, const std::string &path, std::string &rev, std::string &inner);
+
+public:
+    static const std::string DIR;
+
+    static bool match(const std::string &path);
+
+    static std::string name(const Git::Version &version);
+    static std::string resolve(const Git &git, const std::string &name);
+
+    static struct stat getAttr(const Git &git, const std::string &path);
+    static std::vector<Git::FileAttr> listDir(const Git &git, const std::string &path);
+    static Snapshot *open(const Git &git, const std::string &path);
+    static Snapshot *open(Git::BlobPtr &&blob);
+
+    int read(char *buf, size_t size, off_t offset) const;
+    /** Up to `size` bytes at `offset`, without copying. `size` is cut at the end
+     */
+    const char *view(size_t &size, off_t offset) const;
+};
+
+#endif // SNAPSHOT_H_
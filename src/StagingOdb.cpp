@@ -0,0 +1,231 @@
+#include <cstring>
+#include "utils.h"
+#include "StagingOdb.h"
+
+/** Above the packed (2) and loose (1) backends, so writes land here first
+ */
+static constexpr int STAGING_PRIORITY = 3;
+
+std::string StagingOdb::key(const git_oid *id)
+{
+    return std::string((const char *)id->id, GIT_OID_RAWSZ);
+}
+
+StagingOdb *StagingOdb::self(git_odb_backend *backend)
+{
+    return ((Backend *)backend)->self;
+}
+
+StagingOdb *StagingOdb::attach(git_repository *repo, const Config &config)
+{
+    StagingOdb *staging = new StagingOdb;
+    staging->config = config;
+    git_odb_backend &b = staging->backend.parent;
+    git_odb_init_backend(&b, GIT_ODB_BACKEND_VERSION);
+    staging->backend.self = staging;
+    b.read = read;
+    b.read_prefix = readPrefix;
+    b.read_header = readHeader;
+    b.write = write;
+    b.writestream = writeStream;
+    b.exists = exists;
+    b.exists_prefix = existsPrefix;
+    b.free = freeBackend;
+
+    git_odb *odb = nullptr;
+    if (git_repository_odb(&odb, repo) < 0 || git_odb_add_backend(odb, &b, STAGING_PRIORITY) < 0)
+    {
+        git_odb_free(odb);
+        delete staging;
+        return nullptr;
+    }
+    git_odb_free(odb);
+    return staging;
+}
+
+bool StagingOdb::store(const git_oid *id, const void *data, std::size_t len, git_otype type)
+{
+    if (len > config.maxObject)
+        return false;
+    std::lock_guard<std::mutex> guard(lock);
+    Object &obj = objects[key(id)];
+    if (obj.data.empty())
+    {
+        obj.type = type;
+        obj.data.assign((const char *)data, len);
+        bytes += len;
+    }
+    return true;
+}
+
+const StagingOdb::Object *StagingOdb::find(const git_oid *prefix, std::size_t len, git_oid *out, int &error) const
+{
+    const Object *found = nullptr;
+    error = GIT_ENOTFOUND;
+    for (const auto &p : objects)
+    {
+        const unsigned char *id = (const unsigned char *)p.first.data();
+        if (memcmp(id, prefix->id, len / 2) != 0 ||
+            ((len & 1) && (id[len / 2] & 0xf0) != (prefix->id[len / 2] & 0xf0)))
+            continue;
+        if (found)
+        {
+            error = GIT_EAMBIGUOUS;
+            return nullptr;
+        }
+        found = &p.second;
+        git_oid_fromraw(out, id);
+        error = 0;
+    }
+    return found;
+}
+
+int StagingOdb::read(void **data, std::size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *id)
+{
+    StagingOdb *staging = self(backend);
+    std::lock_guard<std::mutex> guard(staging->lock);
+    auto iter = staging->objects.find(key(id));
+    if (iter == staging->objects.end())
+        return GIT_ENOTFOUND;
+    const Object &obj = iter->second;
+    *data = git_odb_backend_malloc(backend, obj.data.length());
+    if (!*data)
+        return GIT_ERROR;
+    memcpy(*data, obj.data.data(), obj.data.length());
+    *len = obj.data.length();
+    *type = obj.type;
+    return 0;
+}
+
+int StagingOdb::readPrefix(git_oid *out, void **data, std::size_t *len, git_otype *type,
+                           git_odb_backend *backend, const git_oid *prefix, std::size_t prefixLen)
+{
+    StagingOdb *staging = self(backend);
+    std::lock_guard<std::mutex> guard(staging->lock);
+    int error;
+    const Object *obj = staging->find(prefix, prefixLen, out, error);
+    if (!obj)
+        return error;
+    *data = git_odb_backend_malloc(backend, obj->data.length());
+    if (!*data)
+        return GIT_ERROR;
+    memcpy(*data, obj->data.data(), obj->data.length());
+    *len = obj->data.length();
+    *type = obj->type;
+    return 0;
+}
+
+int StagingOdb::readHeader(std::size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *id)
+{
+    StagingOdb *staging = self(backend);
+    std::lock_guard<std::mutex> guard(staging->lock);
+    auto iter = staging->objects.find(key(id));
+    if (iter == staging->objects.end())
+        return GIT_ENOTFOUND;
+    *len = iter->second.data.length();
+    *type = iter->second.type;
+    return 0;
+}
+
+int StagingOdb::write(git_odb_backend *backend, const git_oid *id, const void *data, std::size_t len, git_otype type)
+{
+    return self(backend)->store(id, data, len, type) ? 0 : GIT_PASSTHROUGH;
+}
+
+int StagingOdb::writeStream(git_odb_stream **out, git_odb_backend *backend, git_off_t size, git_otype type)
+{
+    if ((std::size_t)size > self(backend)->config.maxObject)
+        return GIT_PASSTHROUGH;
+
+    Stream *stream = new Stream;
+    memset(&stream->parent, 0, sizeof stream->parent);
+    stream->parent.backend = backend;
+    stream->parent.mode = GIT_STREAM_WRONLY;
+    stream->type = type;
+    stream->data.reserve(size);
+    stream->parent.write = [] (git_odb_stream *s, const char *buffer, std::size_t len) -> int
+    {
+        ((Stream *)s)->data.append(buffer, len);
+        return 0;
+    };
+    stream->parent.finalize_write = [] (git_odb_stream *s, const git_oid *id) -> int
+    {
+        Stream *stream = (Stream *)s;
+        self(s->backend)->store(id, stream->data.data(), stream->data.length(), stream->type);
+        return 0;
+    };
+    stream->parent.free = [] (git_odb_stream *s)
+    {
+        delete (Stream *)s;
+    };
+    *out = &stream->parent;
+    return 0;
+}
+
+int StagingOdb::exists(git_odb_backend *backend, const git_oid *id)
+{
+    StagingOdb *staging = self(backend);
+    std::lock_guard<std::mutex> guard(staging->lock);
+    return staging->objects.count(key(id));
+}
+
+int StagingOdb::existsPrefix(git_oid *out, git_odb_backend *backend, const git_oid *prefix, std::size_t prefixLen)
+{
+    StagingOdb *staging = self(backend);
+    std::lock_guard<std::mutex> guard(staging->lock);
+    int error;
+    staging->find(prefix, prefixLen, out, error);
+    return error;
+}
+
+void StagingOdb::freeBackend(git_odb_backend *backend)
+{
+    delete self(backend);
+}
+
+bool StagingOdb::full() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return bytes >= config.maxBytes;
+}
+
+int StagingOdb::flush(git_repository *repo, const std::string &packDir)
+{
+    std::vector<git_oid> ids;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto &p : objects)
+        {
+            git_oid id;
+            git_oid_fromraw(&id, (const unsigned char *)p.first.data());
+            ids.push_back(id);
+        }
+    }
+    if (ids.empty())
+        return 0;
+
+    git_packbuilder *pb = nullptr;
+    int error = git_packbuilder_new(&pb, repo);
+    for (std::size_t i = 0; error == 0 && i < ids.size(); i++)
+        error = git_packbuilder_insert(pb, &ids[i], nullptr);
+    if (error == 0)
+        error = git_packbuilder_write(pb, packDir.c_str(), 0, nullptr, nullptr);
+    git_packbuilder_free(pb);
+
+    git_odb *odb = nullptr;
+    if (error == 0 && (error = git_repository_odb(&odb, repo)) == 0)
+        error = git_odb_refresh(odb);
+    git_odb_free(odb);
+    if (error < 0)
+        return error;
+
+    std::lock_guard<std::mutex> guard(lock);
+    for (const auto &id : ids)
+    {
+        auto iter = objects.find(key(&id));
+        bytes -= iter->second.data.length();
+        objects.erase(iter);
+    }
+    LOG << "Flushed " << ids.size() << " staged objects" << std::endl;
+    return 0;
+}
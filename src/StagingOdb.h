@@ -0,0 +1,79 @@
+#ifndef STAGING_ODB_H_
+#define STAGING_ODB_H_
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <git2.h>
+
+/** In-memory object database backend
+ *
+ *  Newly created objects are held in memory until `flush` writes all of them into a
+ *  single packfile (plus index). Objects larger than `maxObject` pass through to the
+ *  loose backend.
+ */
+class StagingOdb
+{
+public:
+    struct Config
+    {
+        std::size_t maxBytes = 64 << 20; /// Flush once this many bytes are staged
+        std::size_t maxObject = 16 << 20; /// Larger objects are written loose
+    };
+
+private:
+    struct Object
+    {
+        git_otype type;
+        std::string data;
+    };
+
+    struct Backend
+    {
+        git_odb_backend parent;
+        StagingOdb *self;
+    };
+
+    struct Stream
+    {
+        git_odb_stream parent;
+        git_otype type;
+        std::string data;
+    };
+
+    Config config;
+    Backend backend;
+    std::unordered_map<std::string, Object> objects; /// Keyed by raw oid
+    std::size_t bytes = 0;
+    mutable std::mutex lock;
+
+    static std::string key(const git_oid *id);
+    static StagingOdb *self(git_odb_backend *backend);
+    bool store(const git_oid *id, const void *data, std::size_t len, git_otype type);
+    const Object *find(const git_oid *prefix, std::size_t len, git_oid *out, int &error) const;
+
+    static int read(void **data, std::size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *id);
+    static int readPrefix(git_oid *out, void **data, std::size_t *len, git_otype *type,
+                          git_odb_backend *backend, const git_oid *prefix, std::size_t prefixLen);
+    static int readHeader(std::size_t *len, git_otype *type, git_odb_backend *backend, const git_oid *id);
+    static int write(git_odb_backend *backend, const git_oid *id, const void *data, std::size_t len, git_otype type);
+    static int writeStream(git_odb_stream **out, git_odb_backend *backend, git_off_t size, git_otype type);
+    static int exists(git_odb_backend *backend, const git_oid *id);
+    static int existsPrefix(git_oid *out, git_odb_backend *backend, const git_oid *prefix, std::size_t prefixLen);
+    static void freeBackend(git_odb_backend *backend);
+
+public:
+    /** Register a staging backend in the object database of `repo`. The odb owns it
+     */
+    static StagingOdb *attach(git_repository *repo, const Config &config);
+
+    bool full() const;
+
+    /** Write all staged objects into one packfile under `packDir`
+     *  @return libgit2 error code
+     */
+    int flush(git_repository *repo, const std::string &packDir);
+};
+
+#endif // STAGING_ODB_H_
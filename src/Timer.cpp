@@ -1,11 +1,14 @@
 #include <cstdio>
 #include <cassert>
 #include <unistd.h>
+#include "Git.h"
 #include "Timer.h"
 #include "utils.h"
 #include "OpenContext.h"
 
 std::thread Timer::timer_thread;
+std::thread Timer::flush_thread;
+std::thread Timer::meta_cache_thread;
 
 void Timer::timer_loop(int interval)
 {
@@ -14,16 +17,11 @@ void Timer::timer_loop(int interval)
     while (true)
     {
         LOG << "Timed out, setting commit flags..." << std::endl;
-        OpenContext::openContextsLock.lock();
-        for (auto &p : OpenContext::contexts())
+        OpenContext::for_each([] (OpenContext *ctx)
         {
-            for (OpenContext *ctx : p.second)
-            {
-                ctx->commit_on_next_write = true;
-                LOG << "Find a context." << std::endl;
-            }
-        }
-        OpenContext::openContextsLock.unlock();
+            ctx->commit_on_next_write = true;
+            LOG << "Find a context." << std::endl;
+        });
 
         sleep(interval);
     }
@@ -35,3 +33,51 @@ void Timer::start(int commit_interval)
     timer_thread.detach();
 }
 
+
+void Timer::flush_loop(Git *git, int interval)
+{
+    if (interval <= 0) return;
+
+    while (true)
+    {
+        sleep(interval);
+        try
+        {
+            git->flush();
+        }
+        catch (const Git::Error &e)
+        {
+            LOG << e.what() << std::endl;
+        }
+    }
+}
+
+void Timer::startFlush(Git &git, int flush_interval)
+{
+    flush_thread = std::thread(flush_loop, &git, flush_interval);
+    flush_thread.detach();
+}
+
+void Timer::meta_cache_loop(Git *git, int interval)
+{
+    if (interval <= 0) return;
+
+    while (true)
+    {
+        sleep(interval);
+        try
+        {
+            git->saveMetaCache();
+        }
+        catch (const Git::Error &e)
+        {
+            LOG << e.what() << std::endl;
+        }
+    }
+}
+
+void Timer::startMetaCache(Git &git, int save_interval)
+{
+    meta_cache_thread = std::thread(meta_cache_loop, &git, save_interval);
+    meta_cache_thread.detach();
+}
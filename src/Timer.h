@@ -3,15 +3,28 @@
 
 #include <thread>
 
+class Git;
+
 class Timer
 {
 private:
     static void timer_loop(int interval);
+    static void flush_loop(Git *git, int interval);
+    static void meta_cache_loop(Git *git, int interval);
     static std::thread timer_thread;
+    static std::thread flush_thread;
+    static std::thread meta_cache_thread;
 
 public:
     static void start(int commit_interval);
+
+    /** Periodically flush objects staged in memory
+     */
+    static void startFlush(Git &git, int flush_interval);
+
+    /** Periodically snapshot the metadata of the published tree
+     */
+    static void startMetaCache(Git &git, int save_interval);
 };
 
 #endif // TIMER_H_
-
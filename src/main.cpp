@@ -1,148 +1,449 @@
 #define FUSE_USE_VERSION 26
 #define _FILE_OFFSET_BITS 64
 
+#include <cstring>
 #include <unistd.h>
 #include <fstream>
 #include <iostream>
-#include <fuse.h>
+#include <algorithm>
+#include <fuse_lowlevel.h>
 #include <time.h>
+#include <chrono>
+#include <vector>
+#include <functional>
 #include "Git.h"
 #include "utils.h"
 #include "Timer.h"
 #include "mangle.h"
 #include "OpenContext.h"
+#include "Snapshot.h"
+#include "History.h"
+#include "Control.h"
+#include "Repacker.h"
+#include "Journal.h"
+#include "InodeTable.h"
+#include "Invalidator.h"
+#include "IoRing.h"
+#include "SessionLoop.h"
 #include "3rd-party/json.hpp"
 
 using Json = nlohmann::json;
 
 Json config;
 Git *git;
+Journal *journal = nullptr;
+InodeTable *inodes;
 bool commit_on_write = false, read_only = false;
 int commit_interval = -1;
-const char *time_format_str="%d-%d-%d %d:%d:%d";
+double attr_timeout = 60, entry_timeout = 60; /// How long the kernel may cache, in seconds
+double negative_timeout = 0; /// How long the kernel may remember missing names
+bool session_loop = false; /// Serve requests with SessionLoop instead of libfuse's loop
+SessionLoop::Config session_config;
+std::chrono::steady_clock::time_point started; /// When the process started, to report the time to ready
+/** Background threads, started by `fuse_run` once daemonized, as fork(2) leaves
+ *  threads behind in the parent
+ */
+std::vector<std::function<void ()> > background;
 
 static constexpr const char *GITKEEP_MAGIC = ".gitkeep";
 
-time_t string2time(const std::string &str)
+#define CHECK_READONLY() \
+    do { if (read_only) return -EROFS; } while (0)
+
+/** Whether a path is in one of the namespaces not backed by the tree: the history,
+ *  or the control file
+ */
+static bool is_virtual(const std::string &path)
 {
-    // FIXME(twd2): use strptime
-    struct tm tm1;
-    int year,mon,mday,hour,min,sec;
-    if( -1 == sscanf(str.c_str(),time_format_str,&year,&mon,&mday,&hour,&min,&sec)) return -1;
-    tm1.tm_year=year-1900;
-    tm1.tm_mon=mon-1;
-    tm1.tm_mday=mday;
-    tm1.tm_hour=hour;
-    tm1.tm_min=min;
-    tm1.tm_sec=sec;
-    return mktime(&tm1);
+    return Snapshot::match(path) || History::match(path) || Control::match(path);
 }
 
-#define CHECK_READONLY() \
-    do { if (read_only) return -EROFS; } while (0)
+#define CHECK_VIRTUAL(path) \
+    do { if (is_virtual(path)) return -EROFS; } while (0)
+
+/** Commit journaled writes to `path` so that they can be seen in the history
+ */
+static void fold_journal(const std::string &path)
+{
+    if (journal && journal->dirty(path))
+    {
+        RWlock mlock(git->rwlock);
+        journal->fold(*git);
+    }
+}
+
+/** Fill in the times of `path`, which the tree does not have
+ */
+static void set_times(struct stat &st, const std::string &path)
+{
+    git->times(path_mangle(path), &st.st_mtime, &st.st_ctime);
+    st.st_atime = st.st_mtime;
+}
+
+/** Attributes of inode `ino`, whose path is `path`
+ *  @return -ENOENT if it does not exist
+ */
+static int stat_of(fuse_ino_t ino, const std::string &path, struct stat &st)
+{
+    if (Snapshot::match(path))
+        st = Snapshot::getAttr(*git, path);
+    else if (History::match(path))
+        st = History::getAttr(*git, path);
+    else if (Control::match(path))
+        st = Control::getAttr(*git);
+    else
+    {
+        fold_journal(path_mangle(path));
+        Git::FileAttr attr;
+        int err = inodes->getAttr(ino, attr);
+        if (err < 0)
+            return err;
+        st = attr.stat;
+        set_times(st, path);
+    }
+    st.st_ino = ino;
+    return 0;
+}
+
+/** Reply with the entry `name` of `parent`, counting a lookup of it
+ *  @return -errno without replying if there is no such entry
+ */
+static int reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    std::string path = inodes->path(parent, name);
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof e);
+    InodeTable::Inode ino;
+    int err;
+    if (is_virtual(path))
+    {
+        e.attr = Snapshot::match(path) ? Snapshot::getAttr(*git, path) :
+                 History::match(path) ? History::getAttr(*git, path) : Control::getAttr(*git);
+        err = inodes->lookup(parent, name, &ino);
+    }
+    else
+    {
+        fold_journal(path_mangle(path));
+        Git::FileAttr attr;
+        err = inodes->lookup(parent, name, &ino, &attr);
+        e.attr = attr.stat;
+        set_times(e.attr, path);
+    }
+    if (err < 0)
+        return err;
+    e.ino = ino;
+    e.attr.st_ino = e.ino;
+    e.attr_timeout = attr_timeout;
+    e.entry_timeout = entry_timeout;
+    fuse_reply_entry(req, &e);
+    return 0;
+}
+
+/** Reply to a lookup of a missing name, which the kernel may remember for
+ *  `negative_timeout` seconds
+ */
+static void reply_missing(fuse_req_t req)
+{
+    if (negative_timeout <= 0)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof e);
+    e.entry_timeout = negative_timeout;
+    fuse_reply_entry(req, &e);
+}
+
+static void sfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    // The virtual directories are not in the tree of the root
+    if (!(parent == FUSE_ROOT_ID && is_virtual(std::string("/") + name)) && inodes->absent(parent, name))
+    {
+        reply_missing(req);
+        return;
+    }
+    try
+    {
+        int err = reply_entry(req, parent, name);
+        if (err == -ENOENT)
+            reply_missing(req);
+        else if (err)
+            fuse_reply_err(req, -err);
+    }
+    catch (const Git::Error &e)
+    {
+        if (e.unixError() == -ENOENT)
+            reply_missing(req);
+        else
+            fuse_reply_err(req, -e.unixError());
+    }
+}
+
+static void sfs_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    inodes->forget(ino, nlookup);
+    fuse_reply_none(req);
+}
 
-static int sfs_readdir(
-    const char *path, void *buf, fuse_fill_dir_t filler,
-    off_t offset, struct fuse_file_info *fi
-)
+static void sfs_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    UNUSED(offset);
     UNUSED(fi);
-    filler(buf, ".", nullptr, 0);
-    filler(buf, "..", nullptr, 0);
     try
     {
-        auto list = git->listDir(path_mangle(path));
+        struct stat st;
+        int err = stat_of(ino, inodes->path(ino), st);
+        if (err)
+            fuse_reply_err(req, -err);
+        else
+            fuse_reply_attr(req, &st, attr_timeout);
+    }
+    catch (const Git::Error &e)
+    {
+        fuse_reply_err(req, -e.unixError());
+    }
+}
+
+/** Listing of a directory, built by opendir and handed out by readdir
+ */
+struct DirHandle
+{
+    std::vector<char> buf;
+};
+
+static void sfs_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    try
+    {
+        std::string path = inodes->path(ino);
+        bool virt = is_virtual(path);
+        std::vector<Git::FileAttr> list;
+        if (Snapshot::match(path))
+            list = Snapshot::listDir(*git, path);
+        else if (History::match(path))
+            list = History::listDir(*git, path);
+        else
+        {
+            int err = git->listDir(path_mangle(path), list);
+            if (err)
+            {
+                fuse_reply_err(req, -err);
+                return;
+            }
+            for (const auto &name : inodes->pendingNames(ino))
+            {
+                Git::FileAttr attr;
+                attr.name = path_mangle(name);
+                attr.stat.st_mode = S_IFREG;
+                if (std::none_of(list.begin(), list.end(), [&] (const Git::FileAttr &item) { return item.name == attr.name; }))
+                    list.push_back(attr);
+            }
+        }
+        std::unique_ptr<DirHandle> dir(new DirHandle);
+        auto add = [&] (const std::string &name, struct stat st)
+        {
+            st.st_ino = (ino_t)-1; // Unknown until looked up, as the high-level API reports
+            std::size_t size = fuse_add_direntry(req, nullptr, 0, name.c_str(), nullptr, 0);
+            std::size_t offset = dir->buf.size();
+            dir->buf.resize(offset + size);
+            fuse_add_direntry(req, dir->buf.data() + offset, size, name.c_str(), &st, offset + size);
+        };
+        struct stat st;
+        memset(&st, 0, sizeof st);
+        st.st_mode = S_IFDIR;
+        add(".", st);
+        add("..", st);
         for (const auto &item : list)
         {
-            std::string p = path_demangle(item.name);
+            std::string p = virt ? item.name : path_demangle(item.name);
             if (p != "")
             {
-                filler(buf, p.c_str(), &item.stat, 0 /* Offset disabled */);
+                add(p, item.stat);
             }
         }
-        return 0;
+        fi->fh = (uint64_t)(void *)dir.release();
+        fuse_reply_open(req, fi);
     }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        fuse_reply_err(req, -e.unixError());
     }
 }
 
-static int sfs_getattr(const char *path, struct stat *st)
+static void sfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    UNUSED(ino);
+    const std::vector<char> &buf = ((DirHandle *)(void *)fi->fh)->buf;
+    if ((std::size_t)offset < buf.size())
+        fuse_reply_buf(req, buf.data() + offset, std::min(size, buf.size() - offset));
+    else
+        fuse_reply_buf(req, nullptr, 0);
+}
+
+static void sfs_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    UNUSED(ino);
+    delete (DirHandle *)(void *)fi->fh;
+    fuse_reply_err(req, 0);
+}
+
+/** What `fi->fh` of an open file points to: a historical blob, an open file, or the
+ *  control file
+ */
+struct FileHandle
+{
+    std::unique_ptr<Snapshot> snapshot;
+    OpenContext *ctx = nullptr;
+    bool control = false;
+};
+
+static void sfs_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
     try
     {
-        *st = git->getAttr(path_mangle(path)).stat;
-        return 0;
+        std::string path = inodes->path(ino);
+        std::unique_ptr<FileHandle> fh(new FileHandle);
+        if (Control::match(path))
+        {
+            fh->control = true;
+            fi->direct_io = 1; // Its contents change without notice
+        }
+        else if (is_virtual(path))
+        {
+            if ((fi->flags & O_ACCMODE) != O_RDONLY)
+            {
+                fuse_reply_err(req, EROFS);
+                return;
+            }
+            fh->snapshot.reset(Snapshot::match(path) ? Snapshot::open(*git, path) : History::open(*git, path));
+            fi->keep_cache = 1; // Historical blobs never change
+        }
+        else
+        {
+            fold_journal(path_mangle(path));
+            fi->keep_cache = inodes->keepCache(ino); // The pages are still good if the blob is
+            fh->ctx = OpenContext::acquire(path_mangle(path), [&] () -> OpenContext *
+            {
+                bool executable;
+                Git::BlobPtr blob = git->dump(path_mangle(path), &executable);
+                std::size_t size = git_blob_rawsize(blob.get());
+                std::unique_ptr<OpenContext> ctx(new OpenContext(path_mangle(path), size));
+                if (ctx->buffer.fd() < 0 || ctx->buffer.write(git_blob_rawcontent(blob.get()), size, 0) < 0)
+                    throw Git::Error(GIT_ERROR, "open: cannot load " + path_mangle(path));
+                LOG << "dumped " << path << (ctx->buffer.inMemory() ? " to memory" : " to disk") << std::endl;
+                ctx->executable = executable;
+                return ctx.release();
+            });
+        }
+        fi->fh = (uint64_t)(void *)fh.release();
+        fuse_reply_open(req, fi);
     }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        fuse_reply_err(req, -e.unixError());
     }
 }
 
-static int sfs_open(const char *path, struct fuse_file_info *fi)
+static void sfs_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    try
+    UNUSED(ino);
+    std::unique_ptr<FileHandle> fh((FileHandle *)(void *)fi->fh);
+    if (fh->ctx)
     {
-        char tmp[] = "sfstemp.XXXXXX";
-        if (!mktemp(tmp)) // FIXME(twd2): Never use this function.
+        RWlock mlock(git->rwlock);
+        try
         {
-            perror("mktemp");
-            exit(1);
+            OpenContext::release(fh->ctx, *git, "close");
         }
-        bool executable;
-        git->dump(path_mangle(path), tmp, &executable);
-        LOG << "dumped " << tmp << std::endl;
-        OpenContext *ctx = new OpenContext(path_mangle(path), tmp);
-        fi->fh = (uint64_t)(void *)ctx;
-        ctx->fd = open(tmp, O_RDWR);
-        if (ctx->fd < 0)
+        catch (const Git::Error &e)
         {
-            perror("open");
-            delete ctx;
-            fi->fh = 0;
-            return -EIO;
+            LOG << e.what() << std::endl;
         }
-        ctx->executable = executable;
-        return 0;
-    }
-    catch (const Git::Error &e)
-    {
-        return e.unixError();
     }
+    fuse_reply_err(req, 0);
 }
 
-static int sfs_release(const char *path, struct fuse_file_info *fi)
+static void sfs_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    RWlock mlock(git->rwlock);
-    UNUSED(path);
-    OpenContext *ctx = (OpenContext *)(void *)fi->fh;
-    ctx->commit(*git, "close");
-    delete ctx;
-    return 0;
+    UNUSED(ino);
+    FileHandle *fh = (FileHandle *)(void *)fi->fh;
+    if (fh->snapshot)
+    {
+        const char *data = fh->snapshot->view(size, offset);
+        fuse_reply_buf(req, data, size);
+        return;
+    }
+    if (fh->control)
+    {
+        std::string status = Control::status(*git);
+        if ((std::size_t)offset < status.length())
+            fuse_reply_buf(req, status.data() + offset, std::min(size, status.length() - offset));
+        else
+            fuse_reply_buf(req, nullptr, 0);
+        return;
+    }
+    // Readers never wait for commits. FUSE does not release a handle with reads in flight.
+    // The kernel splices the bytes straight from the buffer when it can
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(size);
+    buf.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    buf.buf[0].fd = fh->ctx->buffer.fd();
+    buf.buf[0].pos = offset;
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
 }
 
-static int sfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+/** Bytes of `bufv` in memory, copied into `copy` unless they are there already
+ *  @return Number of bytes, or -errno
+ */
+static ssize_t in_memory(struct fuse_bufvec *bufv, std::vector<char> &copy, const char **out_data)
 {
-    UNUSED(path);
-    RWlock mlock(git->rwlock, false);
-    OpenContext *ctx = (OpenContext *)(void *)fi->fh;
-    int ret;
-    if ((ret = lseek(ctx->fd, offset, SEEK_SET)) < 0) return ret;
-    return read(ctx->fd, buf, size);
+    std::size_t size = fuse_buf_size(bufv);
+    *out_data = (const char *)bufv->buf[0].mem;
+    if (bufv->count > 1 || (bufv->buf[0].flags & FUSE_BUF_IS_FD))
+    {
+        copy.resize(size);
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+        dst.buf[0].mem = copy.data();
+        *out_data = copy.data();
+        return fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags)0);
+    }
+    return size;
 }
 
-static int sfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static int do_write(OpenContext *ctx, struct fuse_bufvec *bufv, off_t offset)
 {
+    std::size_t size = fuse_buf_size(bufv);
+    std::vector<char> copy;
+    const char *data;
+    ssize_t ret;
+    if (journal)
+    {
+        // The journal needs the bytes in memory anyway
+        if ((ret = in_memory(bufv, copy, &data)) < 0) return ret;
+        // The journal commits this write later; no need to wait for the lock
+        if ((ret = ctx->buffer.write(data, ret, offset)) < 0) return ret;
+        int err = journal->append(ctx->filePath(), offset, data, ret);
+        return err < 0 ? err : ret;
+    }
     RWlock mlock(git->rwlock);
-    UNUSED(path);
-    CHECK_READONLY();
-    OpenContext *ctx = (OpenContext *)(void *)fi->fh;
-    int ret;
-    if ((ret = lseek(ctx->fd, offset, SEEK_SET)) < 0) return ret;
-    if ((ret = write(ctx->fd, buf, size)) < 0) return ret;
+    if (ctx->streaming())
+    {
+        // So does the stream
+        if ((ret = in_memory(bufv, copy, &data)) < 0) return ret;
+        ret = ctx->write(data, ret, offset);
+    }
+    else
+    {
+        ctx->fresh = false;
+        ret = ctx->buffer.write(size, offset, [&] ()
+        {
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+            dst.buf[0].flags = (enum fuse_buf_flags)(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+            dst.buf[0].fd = ctx->buffer.fd();
+            dst.buf[0].pos = offset;
+            return fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags)0);
+        });
+    }
+    if (ret < 0) return ret;
     ctx->dirty = true;
     if (commit_on_write || ctx->commit_on_next_write)
     {
@@ -152,168 +453,550 @@ static int sfs_write(const char *path, const char *buf, size_t size, off_t offse
     return ret;
 }
 
-static int sfs_truncate(const char *path, off_t length)
+static void sfs_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+                          struct fuse_file_info *fi)
 {
-    CHECK_READONLY();
-    OpenContext::for_each(path_mangle(path), [=] (OpenContext *ctx) { ctx->truncate(length); });
+    UNUSED(ino);
+    FileHandle *fh = (FileHandle *)(void *)fi->fh;
+    if (read_only || fh->snapshot)
+    {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
     try
     {
-        git->truncate(path_mangle(path), length);
-        return 0;
+        int ret;
+        if (fh->control)
+        {
+            std::vector<char> copy;
+            const char *data;
+            ret = in_memory(bufv, copy, &data);
+            if (ret >= 0)
+            {
+                int err = Control::run(*git, std::string(data, ret));
+                if (err < 0)
+                    ret = err;
+            }
+        }
+        else
+            ret = do_write(fh->ctx, bufv, offset);
+        if (ret < 0)
+            fuse_reply_err(req, -ret);
+        else
+            fuse_reply_write(req, ret);
     }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        fuse_reply_err(req, -e.unixError());
+    }
+}
+
+static int do_truncate(const std::string &path, off_t length)
+{
+    CHECK_READONLY();
+    CHECK_VIRTUAL(path);
+    bool deferred = false;
+    {
+        RWlock mlock(git->rwlock);
+        OpenContext::for_each(path_mangle(path), [&] (OpenContext *ctx)
+        {
+            // The journal replays writes by itself, so it has no use for a stream
+            bool streaming = !journal && ctx->declare(*git, length);
+            if (!streaming)
+                ctx->truncate(length);
+            deferred = streaming || ctx->pending;
+        });
     }
+    if (!deferred) // Otherwise the new size is committed when the file is
+        git->truncate(path_mangle(path), length);
+    return 0;
 }
 
-static int sfs_unlink(const char *path)
+static int do_chmod(const std::string &path, mode_t mode)
 {
     CHECK_READONLY();
+    CHECK_VIRTUAL(path);
+    bool executable = (mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+    bool pending = false;
+    OpenContext::for_each(path_mangle(path), [&] (OpenContext *ctx)
+    {
+        ctx->chmod(executable);
+        pending = ctx->pending;
+    });
+    if (!pending)
+        git->chmod(path_mangle(path), executable);
+    return 0;
+}
+
+static int do_utimens(const std::string &path, time_t mtime)
+{
+    CHECK_READONLY();
+    CHECK_VIRTUAL(path);
+    fold_journal(path_mangle(path));
+    // Commit what is written so far, or its commit would override the time set now.
+    // Holding the lock, no release is committing meanwhile
+    RWlock mlock(git->rwlock);
+    OpenContext::for_each(path_mangle(path), [&] (OpenContext *ctx)
+    {
+        if (ctx->dirty)
+            ctx->commit(*git, ctx->pending ? (ctx->executable ? "create executable" : "create") : "write");
+    });
+    git->touch(path_mangle(path), mtime);
+    return 0;
+}
+
+static void sfs_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+    UNUSED(fi);
     try
     {
-        git->unlink(path_mangle(path));
-        return 0;
+        std::string path = inodes->path(ino);
+        int err = 0;
+        if (Control::match(path))
+            to_set = 0; // Opening it with O_TRUNC is fine
+        if (to_set & FUSE_SET_ATTR_SIZE)
+            err = do_truncate(path, attr->st_size);
+        if (!err && (to_set & FUSE_SET_ATTR_MODE) && !(err = do_chmod(path, attr->st_mode)))
+            inodes->chmod(ino, attr->st_mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+        // Access times are not kept; accept them, otherwise command `touch` will panic
+        if (!err && (to_set & (FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_MTIME_NOW)))
+            err = do_utimens(path, (to_set & FUSE_SET_ATTR_MTIME_NOW) ? time(nullptr) : attr->st_mtime);
+        struct stat st;
+        if (!err)
+            err = stat_of(ino, path, st);
+        if (err)
+            fuse_reply_err(req, -err);
+        else
+            fuse_reply_attr(req, &st, attr_timeout);
     }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        fuse_reply_err(req, -e.unixError());
     }
 }
 
-static int sfs_create(const char *path, mode_t mode, struct fuse_file_info *fi)
+static int do_unlink(const std::string &path)
 {
     CHECK_READONLY();
-    try
+    CHECK_VIRTUAL(path);
     {
-        char tmp[] = "sfstemp.XXXXXX";
-        if (!mktemp(tmp)) // FIXME(twd2): Never use this function.
+        // No context is being released meanwhile
+        RWlock mlock(git->rwlock);
+        bool pending = false;
+        OpenContext::for_each(path_mangle(path), [&] (OpenContext *ctx) { pending = ctx->pending; });
+        if (pending)
         {
-            perror("mktemp");
-            exit(1);
+            OpenContext::detach(path_mangle(path));
+            Git::FileAttr attr;
+            if (git->getAttr(path_mangle(path), attr) == -ENOENT)
+                return 0; // Never committed, nothing to remove
         }
-        OpenContext *ctx = new OpenContext(path_mangle(path), tmp);
-        fi->fh = (uint64_t)(void *)ctx;
-        ctx->fd = open(tmp, O_RDWR | O_CREAT | O_EXCL, 0600);
-        if (ctx->fd < 0)
+    }
+    git->unlink(path_mangle(path));
+    return 0;
+}
+
+static void sfs_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    try
+    {
+        int err = do_unlink(inodes->path(parent, name));
+        if (!err)
+            inodes->unlink(parent, name);
+        fuse_reply_err(req, -err);
+    }
+    catch (const Git::Error &e)
+    {
+        fuse_reply_err(req, -e.unixError());
+    }
+}
+
+static int do_create(const std::string &path, mode_t mode, struct fuse_file_info *fi)
+{
+    CHECK_READONLY();
+    CHECK_VIRTUAL(path);
+    bool fresh = false;
+    std::unique_ptr<FileHandle> fh(new FileHandle);
+    OpenContext *ctx = fh->ctx = OpenContext::acquire(path_mangle(path), [&] () -> OpenContext *
+    {
+        std::unique_ptr<OpenContext> ctx(new OpenContext(path_mangle(path)));
+        if (ctx->buffer.fd() < 0)
+            throw Git::Error(GIT_ERROR, "create: no buffer for " + path_mangle(path));
+        fresh = true;
+        return ctx.release();
+    });
+    fi->fh = (uint64_t)(void *)fh.release();
+    // Other handles of the context may be committing or writing it under the lock
+    RWlock mlock(git->rwlock);
+    if (!fresh)
+        ctx->truncate(0); // Already open by someone else
+    ctx->fresh = fresh;
+    ctx->dirty = true;
+    ctx->executable = (mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+    if (fresh)
+        ctx->pending = true; // Committed once, with its contents, when released
+    if (!ctx->pending)
+        ctx->commit(*git, ctx->executable ? "create executable": "create");
+    return 0;
+}
+
+static void sfs_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+    try
+    {
+        int err = do_create(inodes->path(parent, name), mode, fi);
+        if (err)
         {
-            perror("open");
-            delete ctx;
-            fi->fh = 0;
-            return -EIO;
+            fuse_reply_err(req, -err);
+            return;
         }
-        ctx->dirty = true;
-        ctx->executable = (mode & (S_IXUSR | S_IXGRP | S_IXOTH));
+        OpenContext *ctx = ((FileHandle *)(void *)fi->fh)->ctx;
+        if (ctx->pending)
+            inodes->create(parent, name, ctx->executable);
+        Git::FileAttr attr;
+        InodeTable::Inode ino;
+        err = inodes->lookup(parent, name, &ino, &attr);
+        if (err)
         {
-            RWlock mlock(git->rwlock);
-            ctx->commit(*git, ctx->executable ? "create executable": "create");
+            fuse_reply_err(req, -err);
+            return;
         }
-        return 0;
+        struct fuse_entry_param e;
+        memset(&e, 0, sizeof e);
+        e.ino = ino;
+        e.attr = attr.stat;
+        set_times(e.attr, inodes->path(parent, name));
+        e.attr_timeout = attr_timeout;
+        e.entry_timeout = entry_timeout;
+        fuse_reply_create(req, &e, fi);
     }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        fuse_reply_err(req, -e.unixError());
     }
 }
 
-static int sfs_mkdir(const char *path, mode_t mode)
+static int do_mkdir(const std::string &path)
+{
+    CHECK_READONLY();
+    CHECK_VIRTUAL(path);
+    std::string gitKeep = path_mangle(path) + "/" + GITKEEP_MAGIC;
+    {
+        RWlock mlock(git->rwlock);
+        git->commit("", gitKeep, "mkdir");
+    }
+    return 0;
+}
+
+static void sfs_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
 {
     UNUSED(mode);
+    try
+    {
+        int err = do_mkdir(inodes->path(parent, name));
+        if (!err)
+            err = reply_entry(req, parent, name);
+        if (err)
+            fuse_reply_err(req, -err);
+    }
+    catch (const Git::Error &e)
+    {
+        fuse_reply_err(req, -e.unixError());
+    }
+}
+
+static int do_rmdir(const std::string &path)
+{
     CHECK_READONLY();
+    CHECK_VIRTUAL(path);
+    std::vector<Git::FileAttr> list;
+    int err = git->listDir(path_mangle(path), list);
+    if (err)
+        return err;
+    if (list.size() > 1) // .gitkeep is the last file
+        return -ENOTEMPTY;
+    std::string gitKeep = path_mangle(path) + "/" + GITKEEP_MAGIC;
+    git->unlink(gitKeep, "rmdir");
+    return 0;
+}
+
+static void sfs_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
     try
     {
-        std::string gitKeep = path_mangle(path) + "/" + GITKEEP_MAGIC;
+        if (inodes->hasPending(parent, name))
         {
-            RWlock mlock(git->rwlock);
-            git->commit("", gitKeep, "mkdir");
+            fuse_reply_err(req, ENOTEMPTY);
+            return;
         }
-        return 0;
+        int err = do_rmdir(inodes->path(parent, name));
+        if (!err)
+            inodes->unlink(parent, name);
+        fuse_reply_err(req, -err);
     }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        fuse_reply_err(req, -e.unixError());
     }
 }
 
-static int sfs_rmdir(const char *path)
+static int do_rename(const std::string &oldname, const std::string &newname)
 {
     CHECK_READONLY();
+    CHECK_VIRTUAL(oldname);
+    CHECK_VIRTUAL(newname);
+    {
+        // Pending files are not in the index to be moved yet
+        RWlock mlock(git->rwlock);
+        std::string prefix = path_mangle(oldname) + "/";
+        OpenContext::for_each([&] (OpenContext *ctx)
+        {
+            const std::string &path = ctx->filePath();
+            if (ctx->pending && (path == path_mangle(oldname) || path.compare(0, prefix.length(), prefix) == 0))
+                ctx->commit(*git, ctx->executable ? "create executable": "create");
+        });
+    }
+    git->rename(path_mangle(oldname), path_mangle(newname),
+                [] (const std::string &oldname, const std::string &newname)
+                {
+                    OpenContext::rename(oldname, newname);
+                    LOG << "rename " << oldname.c_str() << " to " << newname.c_str() << std::endl;
+                });
+    return 0;
+}
+
+static void sfs_rename(fuse_req_t req, fuse_ino_t parent, const char *name,
+                       fuse_ino_t newparent, const char *newname)
+{
     try
     {
-        if (git->listDir(path_mangle(path)).size() > 1) // .gitkeep is the last file
-            return -ENOTEMPTY;
-        std::string gitKeep = path_mangle(path) + "/" + GITKEEP_MAGIC;
-        git->unlink(gitKeep, "rmdir");
+        int err = do_rename(inodes->path(parent, name), inodes->path(newparent, newname));
+        if (!err)
+            inodes->rename(parent, name, newparent, newname);
+        fuse_reply_err(req, -err);
+    }
+    catch (const Git::Error &e)
+    {
+        fuse_reply_err(req, -e.unixError());
+    }
+}
+
+/** Extended attributes of files in the tree. They change whenever the contents do,
+ *  so tools can detect changes without reading the contents
+ */
+static const char *const XATTRS[] = {
+    "user.sfs.oid", /// Id of the blob or tree
+    "user.sfs.commit", /// Id of the last commit touching the path
+    "user.sfs.commit_time", /// Its time, in seconds since the epoch
+};
+
+/** Value of the extended attribute `name` of `ino`
+ *  @return -ENODATA if it has none
+ */
+static int xattr_of(fuse_ino_t ino, const std::string &name, std::string &out)
+{
+    std::string path = inodes->path(ino);
+    if (is_virtual(path))
+        return -ENODATA;
+    fold_journal(path_mangle(path));
+    char idstr[GIT_OID_HEXSZ + 1];
+    if (name == XATTRS[0])
+    {
+        Git::FileAttr attr;
+        git_oid id;
+        int err = inodes->getAttr(ino, attr, &id);
+        if (err)
+            return err;
+        if (git_oid_iszero(&id))
+            return -ENODATA; // Created, not committed yet
+        out = git_oid_tostr(idstr, sizeof idstr, &id);
+        return 0;
+    }
+    if (name == XATTRS[1] || name == XATTRS[2])
+    {
+        auto versions = git->listVersions(path_mangle(path));
+        if (versions.empty())
+            return -ENODATA; // Directories are not indexed
+        if (name == XATTRS[1])
+            out = git_oid_tostr(idstr, sizeof idstr, &versions.front().id);
+        else
+            out = std::to_string(versions.front().time);
         return 0;
     }
+    return -ENODATA;
+}
+
+/** Reply with `value` to a request for `size` bytes of it, or for its size if 0
+ */
+static void reply_xattr(fuse_req_t req, const std::string &value, size_t size)
+{
+    if (size == 0)
+        fuse_reply_xattr(req, value.length());
+    else if (size < value.length())
+        fuse_reply_err(req, ERANGE);
+    else
+        fuse_reply_buf(req, value.data(), value.length());
+}
+
+static void sfs_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+{
+    try
+    {
+        std::string value;
+        int err = xattr_of(ino, name, value);
+        if (err)
+            fuse_reply_err(req, -err);
+        else
+            reply_xattr(req, value, size);
+    }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        fuse_reply_err(req, -e.unixError());
     }
 }
 
-static int sfs_opendir(const char *path, struct fuse_file_info *fi)
+static void sfs_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size)
 {
-    UNUSED(path);
-    UNUSED(fi);
-    return 0;
+    try
+    {
+        std::string names, value;
+        for (const char *name : XATTRS)
+            if (xattr_of(ino, name, value) == 0)
+                names.append(name, strlen(name) + 1);
+        reply_xattr(req, names, size);
+    }
+    catch (const Git::Error &e)
+    {
+        fuse_reply_err(req, -e.unixError());
+    }
 }
 
-static int sfs_releasedir(const char *path, struct fuse_file_info *fi)
+static void sfs_init(void *userdata, struct fuse_conn_info *conn)
 {
-    UNUSED(path);
-    UNUSED(fi);
-    return 0;
+    UNUSED(userdata);
+    // Let the kernel splice file data in both directions. SessionLoop reads requests
+    // into memory, so it can only splice replies
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+    if (!session_loop)
+        conn->want |= conn->capable & FUSE_CAP_SPLICE_READ;
 }
 
-static int sfs_chmod(const char *path, mode_t mode)
+static void sfs_destroy(void *userdata)
 {
-    CHECK_READONLY();
-    bool executable = (mode & (S_IXUSR | S_IXGRP | S_IXOTH));
-    OpenContext::for_each(path_mangle(path), [=] (OpenContext *ctx) { ctx->chmod(executable); });
+    UNUSED(userdata);
     try
     {
-        git->chmod(path_mangle(path), executable);
-        return 0;
+        if (git->abortTransaction())
+            LOG << "transaction left open, aborted" << std::endl;
+        git->flush();
+        git->saveMetaCache();
     }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        LOG << e.what() << std::endl;
     }
 }
 
-static int sfs_rename(const char *oldname, const char *newname)
+/** Read-only engine
+ *
+ *  With `read_only`, nothing can change the published tree, so every file is served
+ *  straight from its blob: no lock, no tmpfile, no OpenContext and no timer. The
+ *  kernel is allowed to cache attributes, entries and pages for as long as it likes.
+ */
+static constexpr const char *READ_ONLY_FUSE_OPTIONS = "ro";
+static constexpr double READ_ONLY_TIMEOUT = 31536000;
+
+static void ro_destroy(void *userdata)
 {
-    CHECK_READONLY();
+    UNUSED(userdata);
     try
     {
-        git->rename(path_mangle(oldname), path_mangle(newname),
-                    [] (const std::string &oldname, const std::string &newname)
-                    {
-                        OpenContext::for_each(oldname, [&] (OpenContext *ctx) { ctx->rename(newname); });
-                        LOG << "rename " << oldname.c_str() << " to " << newname.c_str() << std::endl;
-                    });
-        return 0;
+        git->saveMetaCache();
     }
     catch (const Git::Error &e)
     {
-        return e.unixError();
+        LOG << e.what() << std::endl;
     }
 }
 
-static int sfs_utimens(const char *name, const struct timespec tv[2])
+static void ro_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    // Implement this, otherwise command `touch` will panic
-    UNUSED(name);
-    UNUSED(tv);
-    return 0;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+    {
+        fuse_reply_err(req, EROFS);
+        return;
+    }
+    try
+    {
+        std::string path = inodes->path(ino);
+        std::unique_ptr<FileHandle> fh(new FileHandle);
+        fh->snapshot.reset(
+            Snapshot::match(path) ? Snapshot::open(*git, path) :
+            History::match(path) ? History::open(*git, path) :
+            Snapshot::open(git->blob("HEAD", path_mangle(path))));
+        fi->fh = (uint64_t)(void *)fh.release();
+        fi->keep_cache = 1;
+        fuse_reply_open(req, fi);
+    }
+    catch (const Git::Error &e)
+    {
+        fuse_reply_err(req, -e.unixError());
+    }
+}
+
+/** Mount and serve requests until unmounted, like `fuse_main` of the high-level API
+ */
+static int fuse_run(int argc, char **argv, const struct fuse_lowlevel_ops &ops)
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint = nullptr;
+    int multithreaded, foreground, err = -1;
+    if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) < 0)
+        return 1;
+    struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+    if (ch)
+    {
+        struct fuse_session *se = fuse_lowlevel_new(&args, &ops, sizeof ops, nullptr);
+        if (se)
+        {
+            if (fuse_set_signal_handlers(se) == 0)
+            {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                if (!read_only)
+                    Invalidator::start(*inodes, ch);
+                for (const auto &start : background)
+                    start();
+                LOG << "ready in " << std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - started).count() << " ms" << std::endl;
+                if (session_loop)
+                {
+                    SessionLoop loop(se, ch, session_config);
+                    loop.beforeBatch = [] () { inodes->pin(); };
+                    loop.afterBatch = [] () { inodes->unpin(); };
+                    err = loop.run();
+                }
+                else
+                    err = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+    return err ? 1 : 0;
 }
 
-static struct fuse_operations sfs_ops;
+static struct fuse_lowlevel_ops sfs_ops;
 // CAUTIOUS: If you put `sfs_ops` in the stack, all the things will go wrong!
 
 int main(int argc, char **argv)
 {
+    started = std::chrono::steady_clock::now();
+
 #ifndef NDEBUG
     test_mangle();
 #endif
@@ -335,37 +1018,144 @@ int main(int argc, char **argv)
     read_only = config["read_only"].get<bool>();
     commit_interval = config["commit_interval"].get<int>();
     bool version_selection=config["version_selection"].get<bool>();
-    git = new Git(config["git_path"].get<std::string>()); // Will not be deleted
+    {
+        Git::Options gitOptions;
+        gitOptions.cacheMaxSize = config.value("git_cache_max_size", gitOptions.cacheMaxSize);
+        gitOptions.mwindowSize = config.value("git_mwindow_size", gitOptions.mwindowSize);
+        gitOptions.mwindowMappedLimit = config.value("git_mwindow_mapped_limit", gitOptions.mwindowMappedLimit);
+        git = new Git(config["git_path"].get<std::string>(), gitOptions); // Will not be deleted
+    }
     git->checkSig();
     if (version_selection)
         git->checkout_branch(string2time(config["version_time"].get<std::string>()));
+    if (config.value("meta_cache", false))
+    {
+        git->enableMetaCache();
+        int interval = config.value("meta_cache_interval", 300);
+        background.push_back([interval] () { Timer::startMetaCache(*git, interval); });
+    }
+    if (config.value("warm_up_levels", 0u) > 0)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        git->warmUp(config.value("warm_up_levels", 0u), config.value("warm_up_threads", 4u));
+        LOG << "warm-up took " << std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - begin).count() << " ms" << std::endl;
+    }
+    inodes = new InodeTable(*git, config.value("negative_cache_trees", 1024)); // Will not be deleted
     std::vector<std::string> fuseArgs = config["fuse_args"];
     fuseArgs.insert(fuseArgs.begin(), argv[0]);
+    if (read_only)
+    {
+        fuseArgs.push_back("-o");
+        fuseArgs.push_back(READ_ONLY_FUSE_OPTIONS);
+    }
     const int fuseArgc = fuseArgs.size();
     char *fuseArgv[fuseArgc];
     for (int i = 0; i < fuseArgc; i++)
         fuseArgv[i] = const_cast<char*>(fuseArgs[i].c_str()); // I bet FUSE won't change it
 
-    Timer::start(commit_interval);
+    {
+        OpenBuffer::Config bufferConfig;
+        bufferConfig.maxMemory = config.value("buffer_max_memory", bufferConfig.maxMemory);
+        bufferConfig.budget = config.value("buffer_memory_budget", bufferConfig.budget);
+        bufferConfig.scratchDir = config.value("scratch_dir", bufferConfig.scratchDir);
+        OpenBuffer::configure(bufferConfig);
+        OpenContext::Config contextConfig;
+        contextConfig.streamMin = config.value("stream_min_size", contextConfig.streamMin);
+        OpenContext::configure(contextConfig);
+    }
+    if (config.value("io_uring", false))
+        IoRing::enable(config.value("io_uring_depth", 32));
+
+    session_loop = config.value("session_loop", false);
+    session_config.workers = config.value("workers", session_config.workers);
+    session_config.queue = config.value("worker_queue", session_config.queue);
+    session_config.perCore = config.value("per_core_queues", session_config.perCore);
+    session_config.batch = config.value("batch", session_config.batch);
+    attr_timeout = config.value("attr_timeout", attr_timeout);
+    entry_timeout = config.value("entry_timeout", entry_timeout);
+    negative_timeout = config.value("negative_timeout", negative_timeout);
+
+    if (!read_only && commit_on_write && config.value("write_journal", false))
+    {
+        journal = new Journal(config["git_path"].get<std::string>() + "/sfs-journal"); // Will not be deleted
+        {
+            RWlock mlock(git->rwlock);
+            journal->fold(*git); // Replay what the last mount left behind
+        }
+        git->beforeCommit = [] () { journal->fold(*git); };
+        int interval = config.value("journal_interval", 100);
+        background.push_back([interval] () { journal->start(*git, interval); });
+    }
+
+    if (!read_only && config.value("staging", false))
+    {
+        StagingOdb::Config stagingConfig;
+        stagingConfig.maxBytes = config.value("staging_max_bytes", stagingConfig.maxBytes);
+        stagingConfig.maxObject = config.value("staging_max_object", stagingConfig.maxObject);
+        git->enableStaging(stagingConfig);
+        int interval = config.value("staging_flush_interval", 5);
+        background.push_back([interval] () { Timer::startFlush(*git, interval); });
+    }
+
+    if (read_only)
+    {
+        attr_timeout = entry_timeout = READ_ONLY_TIMEOUT;
+        sfs_ops.init = sfs_init;
+        sfs_ops.lookup = sfs_lookup;
+        sfs_ops.forget = sfs_forget;
+        sfs_ops.getattr = sfs_getattr;
+        sfs_ops.open = ro_open;
+        sfs_ops.release = sfs_release;
+        sfs_ops.read = sfs_read;
+        sfs_ops.opendir = sfs_opendir;
+        sfs_ops.readdir = sfs_readdir;
+        sfs_ops.releasedir = sfs_releasedir;
+        sfs_ops.getxattr = sfs_getxattr;
+        sfs_ops.listxattr = sfs_listxattr;
+        sfs_ops.destroy = ro_destroy;
+        return fuse_run(fuseArgc, fuseArgv, sfs_ops);
+    }
+
+    git->afterCommit = [] (const std::vector<Git::Change> &changes)
+    {
+        inodes->repin();
+        inodes->committed(changes);
+        Invalidator::notify(changes);
+    };
+    background.push_back([] () { Timer::start(commit_interval); });
+    {
+        Repacker::Config repackConfig;
+        repackConfig.looseObjects = config.value("repack_loose_objects", repackConfig.looseObjects);
+        repackConfig.looseBytes = config.value("repack_loose_bytes", repackConfig.looseBytes);
+        repackConfig.idle = config.value("repack_idle", repackConfig.idle);
+        repackConfig.throttle = config.value("repack_throttle", repackConfig.throttle);
+        std::string gitPath = config["git_path"];
+        background.push_back([gitPath, repackConfig] () { Repacker::start(gitPath, repackConfig); });
+    }
 
     // Named struct initializaion is only supported in plain C
     // So we are using assignments here
-    sfs_ops.readdir = sfs_readdir;
+    sfs_ops.init = sfs_init;
+    sfs_ops.lookup = sfs_lookup;
+    sfs_ops.forget = sfs_forget;
     sfs_ops.getattr = sfs_getattr;
+    sfs_ops.setattr = sfs_setattr;
     sfs_ops.open = sfs_open;
     sfs_ops.release = sfs_release;
     sfs_ops.read = sfs_read;
-    sfs_ops.write = sfs_write;
-    sfs_ops.truncate = sfs_truncate;
+    sfs_ops.write_buf = sfs_write_buf;
     sfs_ops.unlink = sfs_unlink;
     sfs_ops.create = sfs_create;
     sfs_ops.mkdir = sfs_mkdir;
     sfs_ops.rmdir = sfs_rmdir;
     sfs_ops.opendir = sfs_opendir;
+    sfs_ops.readdir = sfs_readdir;
     sfs_ops.releasedir = sfs_releasedir;
-    sfs_ops.chmod = sfs_chmod;
     sfs_ops.rename = sfs_rename;
-    sfs_ops.utimens = sfs_utimens;
-    return fuse_main(fuseArgc, fuseArgv, &sfs_ops, NULL);
+    sfs_ops.getxattr = sfs_getxattr;
+    sfs_ops.listxattr = sfs_listxattr;
+    sfs_ops.destroy = sfs_destroy;
+    return fuse_run(fuseArgc, fuseArgv, sfs_ops);
 }
 
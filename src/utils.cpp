@@ -1,4 +1,22 @@
+#include <cstdio>
 #include "utils.h"
 
 std::ostream *logPtr = &std::clog;
 
+static const char *time_format_str = "%d-%d-%d %d:%d:%d";
+
+time_t string2time(const std::string &str)
+{
+    // FIXME(twd2): use strptime
+    struct tm tm1;
+    int year,mon,mday,hour,min,sec;
+    if (6 != sscanf(str.c_str(),time_format_str,&year,&mon,&mday,&hour,&min,&sec)) return -1;
+    tm1.tm_year=year-1900;
+    tm1.tm_mon=mon-1;
+    tm1.tm_mday=mday;
+    tm1.tm_hour=hour;
+    tm1.tm_min=min;
+    tm1.tm_sec=sec;
+    tm1.tm_isdst=-1;
+    return mktime(&tm1);
+}
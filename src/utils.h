@@ -1,6 +1,8 @@
 #ifndef UTILS_H_
 #define UTILS_H_
 
+#include <ctime>
+#include <string>
 #include <iostream>
 
 #define UNUSED(x) ((void)(x)) // Mark a variable as unused to make the compiler happy
@@ -8,5 +10,9 @@
 extern std::ostream *logPtr;
 #define LOG (*logPtr)
 
-#endif // UTILS_H_
+/** Parse a local time in the format of `version_time` in config.json
+ *  @return -1 on failure
+ */
+time_t string2time(const std::string &str);
 
+#endif // UTILS_H_
@@ -0,0 +1,98 @@
+// Replay of the write journal across a remount
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "Git.h"
+#include "Journal.h"
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+static int run(const std::string &dir)
+{
+    std::string gitPath = dir + "/repo.git";
+    std::string journalPath = gitPath + "/sfs-journal";
+
+    {
+        Git git(gitPath);
+        Journal journal(journalPath);
+        CHECK(journal.append("/$a", 0, "a", 1) == 0);
+
+        // A write arrives while the fold commits, so the header is written with a
+        // record still pending
+        bool appended = false;
+        int err = 0;
+        git.afterCommit = [&] (const std::vector<Git::Change> &)
+        {
+            if (!appended)
+            {
+                appended = true;
+                err = journal.append("/$b", 0, "b", 1);
+            }
+        };
+        {
+            RWlock mlock(git.rwlock);
+            journal.fold(git);
+        }
+        CHECK(appended && err == 0);
+        CHECK(!journal.dirty("/$a"));
+        CHECK(journal.dirty("/$b"));
+    } // Unmounted without folding "/$b"
+
+    {
+        Git git(gitPath);
+        Journal journal(journalPath);
+        CHECK(!journal.dirty("/$a")); // Folded before, not replayed again
+        CHECK(journal.dirty("/$b")); // Kept behind the header
+        {
+            RWlock mlock(git.rwlock);
+            journal.fold(git);
+        }
+        CHECK(!journal.dirty("/$b"));
+        CHECK(git.listVersions("/$a").size() == 1);
+        CHECK(git.listVersions("/$b").size() == 1);
+    }
+
+    {
+        Journal journal(journalPath);
+        CHECK(!journal.dirty("/$b"));
+    }
+    return 0;
+}
+
+int main()
+{
+    char dir[] = "/tmp/sfs-journal-test.XXXXXX";
+    if (!mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    // Commits need an identity, which the machine running the test may not have
+    setenv("HOME", dir, 1);
+    unsetenv("XDG_CONFIG_HOME");
+    {
+        std::ofstream config(std::string(dir) + "/.gitconfig");
+        config << "[user]\n\tname = SFS Test\n\temail = sfs-test@localhost\n";
+    }
+
+    int ret;
+    try
+    {
+        ret = run(dir);
+    }
+    catch (const Git::Error &e)
+    {
+        fprintf(stderr, "%s\n", e.what());
+        ret = 1;
+    }
+
+    std::string cmd = std::string("rm -rf ") + dir;
+    if (system(cmd.c_str()) != 0)
+        ret = 1;
+    return ret;
+}
@@ -0,0 +1,95 @@
+/** Copy a file or directory inside an SFS mount without moving its data
+ *
+ *  Usage: sfs-cp SRC DST
+ *
+ *  Both paths must be in the same mount. The copy shares the objects of SRC, so it
+ *  costs one commit whatever its size. As with cp, DST may be an existing directory
+ *  to copy into.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const std::string CONTROL = "/.sfs-control";
+
+/** Absolute path of `path` with symbolic links resolved. Only its parent has to exist
+ *  @return false on failure, with errno set
+ */
+static bool absolute(const std::string &path, std::string &out)
+{
+    char buf[PATH_MAX];
+    if (realpath(path.c_str(), buf))
+    {
+        out = buf;
+        return true;
+    }
+    std::size_t slash = path.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    if (name.empty() || !realpath(dir.c_str(), buf))
+        return false;
+    out = std::string(buf) + (strcmp(buf, "/") == 0 ? "" : "/") + name;
+    return true;
+}
+
+/** Mounting point of the SFS that `path` is in, recognized by its control file
+ *  @return false if `path` is not in any
+ */
+static bool mountOf(const std::string &path, std::string &out)
+{
+    struct stat st;
+    std::string dir = path;
+    do
+    {
+        dir = dir.substr(0, dir.rfind('/')); // "" is the root
+        if (stat((dir + CONTROL).c_str(), &st) == 0)
+        {
+            out = dir;
+            return true;
+        }
+    } while (!dir.empty());
+    return false;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s SRC DST\n", argv[0]);
+        return 2;
+    }
+
+    std::string src, dst;
+    if (!absolute(argv[1], src) || !absolute(argv[2], dst))
+    {
+        perror("sfs-cp");
+        return 1;
+    }
+    struct stat st;
+    if (stat(dst.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+        dst += src.substr(src.rfind('/'));
+
+    std::string mount, dstMount;
+    if (!mountOf(src, mount) || !mountOf(dst, dstMount) || mount != dstMount)
+    {
+        fprintf(stderr, "sfs-cp: %s and %s are not in the same SFS mount\n", src.c_str(), dst.c_str());
+        return 1;
+    }
+
+    std::string command = "clone\t" + src.substr(mount.length()) + "\t" + dst.substr(mount.length()) + "\n";
+    int fd = open((mount + CONTROL).c_str(), O_WRONLY);
+    if (fd < 0 || write(fd, command.data(), command.length()) < 0)
+    {
+        fprintf(stderr, "sfs-cp: cannot clone %s to %s: %s\n", src.c_str(), dst.c_str(), strerror(errno));
+        return 1;
+    }
+    close(fd);
+    return 0;
+}